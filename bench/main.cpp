@@ -0,0 +1,401 @@
+#include "FovClient.h"
+#include "FovServer.h"
+#include "Pacer.h"
+
+#include <cxxopts.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+uint64_t NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct Case
+{
+    size_t payloadBytes;
+    size_t numObjects;
+    size_t numSubscribers;
+    double rate;
+};
+
+struct ProcessUsage
+{
+    double cpuSeconds;
+    uint64_t peakRssBytes;
+};
+
+ProcessUsage GetProcessUsage()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    auto seconds = [](const FILETIME& t) {
+        return ((static_cast<uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime) * 1e-7;
+    };
+    PROCESS_MEMORY_COUNTERS memory{};
+    GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory));
+    return { seconds(kernel) + seconds(user), memory.PeakWorkingSetSize };
+#else
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    auto seconds = [](const timeval& t) { return t.tv_sec + t.tv_usec * 1e-6; };
+#ifdef __APPLE__
+    const uint64_t peakRssBytes = usage.ru_maxrss;
+#else
+    const uint64_t peakRssBytes = static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+    return { seconds(usage.ru_utime) + seconds(usage.ru_stime), peakRssBytes };
+#endif
+}
+
+// Counts what a subscriber received of the events published from measureFrom on,
+// recording their publish-to-callback latencies into those of all the subscribers.
+class Subscriber
+{
+public:
+    Subscriber(const std::atomic<uint64_t>& measureFrom, LatencyHistogram& latencies)
+        : measureFrom_(measureFrom), latencies_(latencies)
+    {
+    }
+
+    void onEvent(const PlainFoiEvent& event)
+    {
+        const auto now = NowNs();
+        isWarm_ = true;
+        if (event.timestamp < measureFrom_)
+        {
+            return;
+        }
+        latencies_.record(now - event.timestamp);
+        lastReceived_ = now;
+        ++numReceived_;
+    }
+
+    bool isWarm() const { return isWarm_; }
+    size_t received() const { return numReceived_; }
+    uint64_t lastReceived() const { return lastReceived_; }
+
+private:
+    const std::atomic<uint64_t>& measureFrom_;
+    LatencyHistogram& latencies_;
+    std::atomic_bool isWarm_{ false };
+    std::atomic<size_t> numReceived_{ 0 };
+    std::atomic<uint64_t> lastReceived_{ 0 };
+};
+
+using Result = std::vector<std::pair<const char*, double>>;
+
+PlainFoiEvent MakeEvent(const std::shared_ptr<const PlainFoiImage>& image, size_t numObjects, uint64_t sduId)
+{
+    PlainFoiEvent event;
+    event.fov_id = "bench";
+    event.sdu_id = sduId;
+    event.coordinate = "0;0";
+    event.image = image;
+    for (size_t i = 0; i < numObjects; ++i)
+    {
+        const auto x = static_cast<int32_t>(i * 16);
+        event.objects.push_back({ x, x, 64, 64, 1.f, x + 32.f, x + 32.f, "object", 0.9f, i + 1 });
+    }
+    event.timestamp = NowNs();
+    return event;
+}
+
+Result Run(const Case& c, const std::string& address, const ServerOptions& serverOptions,
+    const SubscribeOptions& subscribeOptions, std::chrono::duration<double> duration)
+{
+    using namespace std::chrono;
+
+    std::vector<char> payload(c.payloadBytes);
+    for (size_t i = 0; i < payload.size(); ++i)
+    {
+        payload[i] = static_cast<char>(i * 31);
+    }
+    const auto image = std::make_shared<const PlainFoiImage>(PlainFoiImage{ 640, 480, std::move(payload) });
+
+    auto server = MakePublishSubscribeServer(address, serverOptions);
+
+    std::atomic<uint64_t> measureFrom{ UINT64_MAX };
+    LatencyHistogram latencies;
+    std::vector<std::unique_ptr<Subscriber>> subscribers;
+    std::vector<std::unique_ptr<IPublishSubscribeClient>> clients;
+    for (size_t i = 0; i < c.numSubscribers; ++i)
+    {
+        subscribers.push_back(std::make_unique<Subscriber>(measureFrom, latencies));
+        auto subscriber = subscribers.back().get();
+        clients.push_back(MakePublishSubscribeClient(address, std::to_string(i),
+            [subscriber](const PlainFoiEvent& event) { subscriber->onEvent(event); }, subscribeOptions));
+    }
+
+    // Until every subscriber is connected.
+    uint64_t sduId = 0;
+    const auto warmupEnd = Clock::now() + seconds(10);
+    while (!std::all_of(subscribers.begin(), subscribers.end(), [](auto& s) { return s->isWarm(); }))
+    {
+        if (Clock::now() > warmupEnd)
+        {
+            throw std::runtime_error("Subscribers did not connect to " + address);
+        }
+        server->Push(MakeEvent(image, c.numObjects, sduId++));
+        std::this_thread::sleep_for(milliseconds(10));
+    }
+    const auto numWarmupDropped = server->GetDroppedCount();
+
+    const auto usageBefore = GetProcessUsage();
+    const auto start = NowNs();
+    measureFrom = start;
+    Pacer pacer(c.rate, 1, seconds(0));
+    size_t numPublished = 0;
+    const auto end = Clock::now() + duration_cast<Clock::duration>(duration);
+    while (Clock::now() < end)
+    {
+        pacer.wait();
+        server->Push(MakeEvent(image, c.numObjects, sduId++));
+        ++numPublished;
+    }
+
+    // Until everything is delivered or dropped, that is until deliveries stop.
+    const auto expected = numPublished * c.numSubscribers;
+    auto received = [&subscribers]() {
+        size_t result = 0;
+        for (auto& s : subscribers)
+        {
+            result += s->received();
+        }
+        return result;
+    };
+    auto lastCount = received();
+    auto lastProgress = Clock::now();
+    while (lastCount < expected && Clock::now() - lastProgress < milliseconds(500))
+    {
+        std::this_thread::sleep_for(milliseconds(10));
+        const auto count = received();
+        if (count != lastCount)
+        {
+            lastCount = count;
+            lastProgress = Clock::now();
+        }
+    }
+    const auto usageAfter = GetProcessUsage();
+
+    uint64_t lastReceived = start;
+    for (auto& s : subscribers)
+    {
+        lastReceived = std::max(lastReceived, s->lastReceived());
+    }
+    const auto numDropped = server->GetDroppedCount() - numWarmupDropped;
+
+    // The stages of the traced messages, warm-up included, across the subscribers.
+    std::array<LatencyHistogram, kNumTraceStages> stages;
+    for (auto& client : clients)
+    {
+        if (auto trace = client->GetTraceHistograms())
+        {
+            for (size_t i = 0; i < kNumTraceStages; ++i)
+            {
+                stages[i].add(trace->stage(static_cast<TraceStage>(i)));
+            }
+        }
+    }
+    const bool isTraced = subscribeOptions.trace;
+
+    clients.clear();
+    server.reset();
+
+    const double seconds = (lastReceived - start) * 1e-9;
+    const double numDelivered = static_cast<double>(latencies.count());
+    const double perSecond = (seconds > 0) ? 1 / seconds : 0;
+    const double us = 1e-3;
+    Result result {
+        { "payload_bytes", static_cast<double>(c.payloadBytes) },
+        { "objects", static_cast<double>(c.numObjects) },
+        { "subscribers", static_cast<double>(c.numSubscribers) },
+        { "rate", c.rate },
+        { "published", static_cast<double>(numPublished) },
+        { "delivered", numDelivered },
+        { "dropped", static_cast<double>(numDropped) },
+        { "seconds", seconds },
+        { "msgs_per_s", numDelivered * perSecond },
+        { "mb_per_s", numDelivered * c.payloadBytes * perSecond / (1024 * 1024) },
+        { "latency_p50_us", latencies.percentile(50) * us },
+        { "latency_p99_us", latencies.percentile(99) * us },
+        { "latency_p999_us", latencies.percentile(99.9) * us },
+        { "latency_max_us", latencies.max() * us },
+        { "cpu_us_per_msg",
+            (numDelivered > 0) ? (usageAfter.cpuSeconds - usageBefore.cpuSeconds) * 1e6 / numDelivered : 0. },
+        { "peak_rss_mb", usageAfter.peakRssBytes / (1024. * 1024.) },
+    };
+    if (isTraced)
+    {
+        const std::pair<const char*, TraceStage> columns[] = {
+            { "serialize_p99_us", TraceStage::SERIALIZED },
+            { "queue_p99_us", TraceStage::DEQUEUED },
+            { "transport_p99_us", TraceStage::RECEIVED },
+            { "parse_p99_us", TraceStage::PARSED },
+            { "callback_p99_us", TraceStage::DELIVERED },
+        };
+        for (const auto& column : columns)
+        {
+            result.emplace_back(column.first, stages[static_cast<size_t>(column.second)].percentile(99) * us);
+        }
+    }
+    return result;
+}
+
+template<typename T>
+std::vector<T> ParseList(const std::string& text)
+{
+    std::vector<T> result;
+    std::istringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        std::istringstream itemStream(item);
+        T value;
+        if (!(itemStream >> value))
+        {
+            throw std::invalid_argument("Invalid list: " + text);
+        }
+        result.push_back(value);
+    }
+    return result;
+}
+
+// Counts without exponent, the rest with 6 significant digits.
+std::string Format(double value)
+{
+    std::ostringstream result;
+    if (value == std::floor(value) && std::fabs(value) < 1e15)
+    {
+        result << static_cast<int64_t>(value);
+    }
+    else
+    {
+        result << std::setprecision(6) << value;
+    }
+    return result.str();
+}
+
+void Print(std::ostream& out, const Result& result, bool isJson, bool isFirst)
+{
+    if (isJson)
+    {
+        out << '{';
+        for (size_t i = 0; i < result.size(); ++i)
+        {
+            out << (i ? ", " : "") << '"' << result[i].first << "\": " << Format(result[i].second);
+        }
+        out << "}\n";
+        return;
+    }
+    if (isFirst)
+    {
+        for (size_t i = 0; i < result.size(); ++i)
+        {
+            out << (i ? "," : "") << result[i].first;
+        }
+        out << '\n';
+    }
+    for (size_t i = 0; i < result.size(); ++i)
+    {
+        out << (i ? "," : "") << Format(result[i].second);
+    }
+    out << '\n';
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    try {
+        cxxopts::Options options("FovBenchmark",
+            "Publishes events to in-process subscribers over loopback, for every combination of the listed values");
+
+        options.add_options()
+            ("a,addr", "Loopback address of the server", cxxopts::value<std::string>()->default_value("127.0.0.1:50071"))
+            ("payloads", "Image sizes in bytes", cxxopts::value<std::string>()->default_value("1024,65536,1048576"))
+            ("objects", "Numbers of objects per event", cxxopts::value<std::string>()->default_value("0,32"))
+            ("subscribers", "Numbers of subscribers", cxxopts::value<std::string>()->default_value("1,4"))
+            ("rates", "Events published per second, 0 for as fast as possible", cxxopts::value<std::string>()->default_value("1000,0"))
+            ("d,duration", "Publishing time per combination in seconds", cxxopts::value<double>()->default_value("2"))
+            ("q,queue", "Maximum number of messages queued per subscriber", cxxopts::value<size_t>()->default_value("1000"))
+            ("batched", "Have the subscribers receive batches", cxxopts::value<bool>()->default_value("false"))
+            ("trace", "Also report the p99 time spent in each stage, from the trace stamps",
+                cxxopts::value<bool>()->default_value("false"))
+            ("f,format", "Output format: json (one object per line) or csv", cxxopts::value<std::string>()->default_value("json"))
+            ("o,output", "Output file, standard output if empty", cxxopts::value<std::string>()->default_value({}))
+            ;
+
+        auto result = options.parse(argc, argv);
+
+        const auto format = result["format"].as<std::string>();
+        if (format != "json" && format != "csv") {
+            throw std::invalid_argument("Unknown format: " + format);
+        }
+
+        ServerOptions serverOptions;
+        serverOptions.maxQueuedMessages = result["queue"].as<size_t>();
+
+        SubscribeOptions subscribeOptions;
+        subscribeOptions.batched = result["batched"].as<bool>();
+        subscribeOptions.trace = result["trace"].as<bool>();
+
+        const auto address = result["addr"].as<std::string>();
+        const std::chrono::duration<double> duration(result["duration"].as<double>());
+
+        std::ofstream file;
+        const auto outputPath = result["output"].as<std::string>();
+        if (!outputPath.empty()) {
+            file.open(outputPath);
+            if (!file) {
+                throw std::runtime_error("Cannot write to " + outputPath);
+            }
+        }
+        std::ostream& out = outputPath.empty() ? std::cout : file;
+
+        bool isFirst = true;
+        for (auto payloadBytes : ParseList<size_t>(result["payloads"].as<std::string>()))
+        for (auto numObjects : ParseList<size_t>(result["objects"].as<std::string>()))
+        for (auto numSubscribers : ParseList<size_t>(result["subscribers"].as<std::string>()))
+        for (auto rate : ParseList<double>(result["rates"].as<std::string>()))
+        {
+            const Case c{ payloadBytes, numObjects, numSubscribers, rate };
+            std::cerr << "payload " << payloadBytes << ", objects " << numObjects << ", subscribers "
+                << numSubscribers << ", rate " << rate << '\n';
+            Print(out, Run(c, address, serverOptions, subscribeOptions, duration), format == "json", isFirst);
+            out.flush();
+            isFirst = false;
+        }
+    }
+    catch (const std::exception& ex) {
+        std::cerr << "Exception " << typeid(ex).name() << ": " << ex.what() << '\n';
+        return EXIT_FAILURE;
+    }
+}
@@ -137,7 +137,8 @@ Default gRPC logging verbosity 
 */
 
 
-int main()
+// The fov_ids to show may be passed as arguments; all of them are shown otherwise.
+int main(int argc, char* argv[])
 {
     setSignalHandler();
 
@@ -149,14 +150,24 @@ int main()
     putenv("GRPC_TRACE=http,http2_stream_state,connectivity_state");
 
     try {
-        FQueue<PlainFoiEvent, 10 * 1024 * 1024, 10> queue;
+        enum { kMaxQueueBytes = 10 * 1024 * 1024, kMaxQueueFrames = 10 };
+        FQueue<PlainFoiEvent, kMaxQueueBytes, kMaxQueueFrames> queue;
 
         cv::namedWindow(windowName, cv::WINDOW_NORMAL);
 
         auto lam = [&queue](const PlainFoiEvent& notification) {
             queue.push(notification);
         };
-        client = MakePublishSubscribeClient("localhost:50051", "42", lam);
+        SubscribeOptions options;
+        options.fovIds.assign(argv + 1, argv + argc);
+        // No more events nor bytes than the queue holds are received ahead of the display,
+        // so that pushing never blocks; the others wait on the server. The credit counts
+        // whole messages, which are larger than their images, and the queue only blocks
+        // once over its bounds, so the last event sent within the credit still fits.
+        options.creditMessages = kMaxQueueFrames;
+        options.creditBytes = kMaxQueueBytes;
+        options.manualCredit = true;
+        client = MakePublishSubscribeClient("localhost:50051", "42", lam, options);
 
         for (auto state = client->GetConnectionState(true)
             ; state != IPublishSubscribeClient::GRPC_CHANNEL_READY
@@ -174,8 +185,9 @@ int main()
         PlainFoiEvent notification;
         while (queue.pop(notification))
         {
+            client->GrantCredit(1);
             std::cout << notification.coordinate << ' ' << notification.image->data.size() << '\n';
-            auto frame = cv::imdecode(notification.image->data, cv::IMREAD_COLOR);
+            auto frame = cv::imdecode(cv::_InputArray(notification.image->data.data(), static_cast<int>(notification.image->data.size())), cv::IMREAD_COLOR);
 
             int i = 0;
             for (auto& v : notification.objects)
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+// Runs tasks on an executor, those posted with the same key in order and one at a
+// time, those of different keys possibly in parallel.
+// Each key with tasks posted has a strand, which is submitted to the executor once
+// and runs a few of its tasks before being submitted again, so that a busy key does
+// not hold an executor thread for long. The executor is either a pool of numThreads
+// threads or the one given, which must eventually run every function it is passed.
+class CallbackDispatcher
+{
+public:
+    using Task = std::function<void()>;
+    using Executor = std::function<void(std::function<void()>)>;
+
+    CallbackDispatcher(size_t numThreads, Executor executor, size_t maxPending)
+        : executor_(std::move(executor))
+        , maxPending_(std::max<size_t>(maxPending, 1))
+    {
+        if (!executor_)
+        {
+            for (size_t i = 0; i < std::max<size_t>(numThreads, 1); ++i)
+            {
+                threads_.emplace_back(&CallbackDispatcher::RunPool, this);
+            }
+            executor_ = [this](std::function<void()> f) {
+                {
+                    std::lock_guard<std::mutex> locker(poolMutex_);
+                    pool_.push_back(std::move(f));
+                }
+                poolCv_.notify_one();
+            };
+        }
+    }
+
+    CallbackDispatcher(const CallbackDispatcher&) = delete;
+    CallbackDispatcher& operator=(const CallbackDispatcher&) = delete;
+
+    // Waits for the tasks posted to be done.
+    ~CallbackDispatcher()
+    {
+        {
+            std::unique_lock<std::mutex> locker(mutex_);
+            ++numWaiting_;
+            cv_.wait(locker, [this] { return numPending_ == 0; });
+        }
+        {
+            std::lock_guard<std::mutex> locker(poolMutex_);
+            stop_ = true;
+        }
+        poolCv_.notify_all();
+        for (auto& thread : threads_)
+        {
+            thread.join();
+        }
+    }
+
+    // Waits while maxPending tasks are posted and not done yet.
+    void post(uint64_t key, Task task)
+    {
+        bool submit = false;
+        {
+            std::unique_lock<std::mutex> locker(mutex_);
+            if (numPending_ >= maxPending_)
+            {
+                ++numWaiting_;
+                cv_.wait(locker, [this] { return numPending_ < maxPending_; });
+                --numWaiting_;
+            }
+            ++numPending_;
+            // A strand exists while submitted to the executor.
+            const auto inserted = strands_.try_emplace(key);
+            inserted.first->second.push_back(std::move(task));
+            submit = inserted.second;
+        }
+        if (submit)
+        {
+            executor_([this, key] { RunStrand(key); });
+        }
+    }
+
+private:
+    enum { kMaxTasksPerRun = 16 };
+
+    void RunStrand(uint64_t key)
+    {
+        std::unique_lock<std::mutex> locker(mutex_);
+        // Strands are only erased here, and references to them survive rehashing.
+        auto& tasks = strands_[key];
+        for (size_t i = 0; i < kMaxTasksPerRun && !tasks.empty(); ++i)
+        {
+            auto task = std::move(tasks.front());
+            tasks.pop_front();
+            locker.unlock();
+            task();
+            locker.lock();
+            --numPending_;
+            if (numWaiting_ > 0)
+            {
+                cv_.notify_all();
+            }
+        }
+        if (tasks.empty())
+        {
+            // Nothing is touched once the lock is released: the destructor may be done waiting.
+            strands_.erase(key);
+            return;
+        }
+        locker.unlock();
+        // Let the other keys have a go.
+        executor_([this, key] { RunStrand(key); });
+    }
+
+    void RunPool()
+    {
+        for (;;)
+        {
+            std::function<void()> f;
+            {
+                std::unique_lock<std::mutex> locker(poolMutex_);
+                poolCv_.wait(locker, [this] { return stop_ || !pool_.empty(); });
+                if (pool_.empty())
+                {
+                    return;
+                }
+                f = std::move(pool_.front());
+                pool_.pop_front();
+            }
+            f();
+        }
+    }
+
+    Executor executor_;
+    const size_t maxPending_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    // The tasks of each key, not started yet.
+    std::unordered_map<uint64_t, std::deque<Task>> strands_;
+    size_t numPending_ = 0;
+    size_t numWaiting_ = 0;
+
+    std::mutex poolMutex_;
+    std::condition_variable poolCv_;
+    std::deque<std::function<void()>> pool_;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+};
@@ -5,15 +5,16 @@
 #include <grpcpp/grpcpp.h>
 #include <grpc/support/log.h>
 #include <grpcpp/impl/codegen/async_stream.h> // for grpc::ClientAsyncReader
+#include <grpcpp/impl/codegen/proto_utils.h> // for grpc::SerializationTraits of the replies
 
-#include "Delegate.h"
-
-#include <boost/signals2/signal.hpp>
-
+#include <algorithm>
 #include <atomic>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 inline IPublishSubscribeClient::connectivity_state AsConnectivityState(grpc_connectivity_state state)
 {
@@ -46,6 +47,13 @@ inline auto GetChannelArguments()
     return result;
 }
 
+// The path of a method of service S, such as Fov::EventSubscriber, as the server knows it.
+template<typename S>
+std::string MethodPath(const char* method)
+{
+    return std::string("/") + S::service_full_name() + "/" + method;
+}
+
 class ClientCallBase
 {
 public:
@@ -72,23 +80,51 @@ protected:
     }
     void TryCancel() override
     {
-        terminator_();
+        std::lock_guard<std::mutex> locker(contextsMutex_);
+        for (auto* context : contexts_)
+        {
+            context->TryCancel();
+        }
     }
     connectivity_state GetConnectionState(bool try_to_connect) override
     {
         return AsConnectivityState(channel_->GetState(try_to_connect));
     }
+    const TraceHistograms* GetTraceHistograms() const override
+    {
+        return traceHistograms_.get();
+    }
+    void GrantCredit(size_t numMessages) override
+    {
+        std::lock_guard<std::mutex> locker(creditMutex_);
+        if (grantCredit_ && manualCredit_)
+        {
+            grantCredit_(numMessages);
+        }
+    }
+    ClientMetrics GetMetrics() const override
+    {
+        ClientMetrics result;
+        result.receivedMessages = receivedMessages_;
+        result.receivedBytes = receivedBytes_;
+        result.parseTimeCount = parseTimes_.count();
+        result.parseTimeSumUs = parseTimes_.sum() * 1e-3;
+        result.parseTimeP50Us = parseTimes_.percentile(50) * 1e-3;
+        result.parseTimeP99Us = parseTimes_.percentile(99) * 1e-3;
+        result.objectDeltaStreams = objectDeltaStreams_;
+        return result;
+    }
 
 public:
-    ClientImpl(const std::string& targetIpAddress)
+    ClientImpl(const std::string& targetIpAddress, bool trace = false)
         : channel_(grpc::CreateCustomChannel(
             targetIpAddress, grpc::InsecureChannelCredentials(), GetChannelArguments()))
+        , traceHistograms_(trace ? std::make_unique<TraceHistograms>() : nullptr)
     {
     }
     ~ClientImpl() override
     {
-        terminator_();
-        thread_.join();
+        Stop();
     }
 
     void RunAsync()
@@ -96,15 +132,66 @@ public:
         thread_ = std::thread(&ClientImpl::AsyncCompleteRpc, this);
     }
 
+    // Cancels the calls and waits for them to be done. Must be called from the most
+    // derived destructor, while the receivers the calls refer to are still alive.
+    void Stop()
+    {
+        if (thread_.joinable())
+        {
+            TryCancel();
+            thread_.join();
+        }
+    }
+
+    // A context is registered while its call may be cancelled.
+    void addContext(grpc::ClientContext* context)
+    {
+        std::lock_guard<std::mutex> locker(contextsMutex_);
+        contexts_.push_back(context);
+    }
+
+    // Waits for TryCancel if it is cancelling context.
+    void removeContext(grpc::ClientContext* context)
+    {
+        std::lock_guard<std::mutex> locker(contextsMutex_);
+        contexts_.erase(std::remove(contexts_.begin(), contexts_.end(), context), contexts_.end());
+    }
+
+    // Grants credit back to the flow-controlled call, if any; may be called from any thread.
+    void grantCredit(size_t numMessages)
+    {
+        std::lock_guard<std::mutex> locker(creditMutex_);
+        if (grantCredit_)
+        {
+            grantCredit_(numMessages);
+        }
+    }
+
     // The producer-consumer queue we use to communicate asynchronously with the
     // gRPC runtime.
     grpc::CompletionQueue cq_;
     std::atomic<int> numCalls_ = 0;
-    boost::signals2::signal<void()> terminator_;
+
+    std::mutex contextsMutex_;
+    std::vector<grpc::ClientContext*> contexts_;
 
     std::thread thread_;
 
     std::shared_ptr<::grpc::Channel> channel_;
+
+    // Null unless the messages are traced.
+    const std::unique_ptr<TraceHistograms> traceHistograms_;
+
+    std::atomic<uint64_t> receivedMessages_ = 0;
+    std::atomic<uint64_t> receivedBytes_ = 0;
+    std::atomic<size_t> objectDeltaStreams_ = 0;
+    // In nanoseconds.
+    LatencyHistogram parseTimes_;
+
+    // Set by the flow-controlled call while it may grant credit; called with creditMutex_ held.
+    std::mutex creditMutex_;
+    std::function<void(size_t)> grantCredit_;
+    bool manualCredit_ = false;
 };
 
 
@@ -115,38 +202,63 @@ public:
 // https://habr.com/ru/post/340758/
 // https://github.com/Mityuha/grpc_async/blob/master/grpc_async_client.cc
 
+// Parses a message read as is into reply, which is reused unless still referred to.
+template<typename E>
+bool ParseReply(grpc::ByteBuffer& buffer, std::shared_ptr<E>& reply)
+{
+    if (!reply || reply.use_count() != 1)
+    {
+        reply = std::make_shared<E>();
+    }
+    if (!grpc::SerializationTraits<E>::Deserialize(&buffer, reply.get()).ok())
+    {
+        gpr_log(GPR_ERROR, "Could not parse a reply");
+        return false;
+    }
+    return true;
+}
+
+
+// C is called with each reply E and the time it was received, see TraceNow.
+// The replies are read as is and parsed by the call, as gRPC would, so that the
+// time they are received can be told from the time they take to parse.
 template<typename E, typename C>
 class AsyncDownstreamingClientCall : public ClientCallBase
 {
     grpc::ClientContext context;
-    E reply;
+    grpc::ByteBuffer buffer;
+    // Shared with the plain notifications referring to its image bytes.
+    std::shared_ptr<E> reply;
     grpc::Status status{};
     enum CallStatus { START, PROCESS, FINISH } callStatus;
-    std::unique_ptr< grpc::ClientAsyncReader<E> > responder;
+    std::unique_ptr< grpc::ClientAsyncReader<grpc::ByteBuffer> > responder;
 
     ClientImpl* parent_;
 
     C& callback_;
 
 public:
-    template<typename R, typename T>
+    // method is the path of the server streaming method, see MethodPath.
+    template<typename R>
     AsyncDownstreamingClientCall(
         const R& request,
         ClientImpl* parent,
         C& callback,
-        T& stub
+        const std::string& method
     )
     : parent_(parent)
     , callback_(callback)
     {
         ++parent_->numCalls_;
-        responder = stub->AsyncSubscribe(&context, request, &parent_->cq_, this);
-        parent_->terminator_.connect(MakeDelegate<&grpc::ClientContext::TryCancel>(&context));
+        const grpc::internal::RpcMethod rpcMethod(method.c_str(), grpc::internal::RpcMethod::SERVER_STREAMING);
+        responder.reset(grpc::internal::ClientAsyncReaderFactory<grpc::ByteBuffer>::Create(
+            parent_->channel_.get(), &parent_->cq_, rpcMethod, &context, request, true, this));
+        parent_->addContext(&context);
         callStatus = START;
     }
     ~AsyncDownstreamingClientCall()
     {
-        parent_->terminator_.disconnect(MakeDelegate<&grpc::ClientContext::TryCancel>(&context));
+        parent_->removeContext(&context);
         --parent_->numCalls_;
     }
 
@@ -159,7 +271,17 @@ public:
             // falls through
             if (ok)
             {
-                callback_(AsPlain(reply));
+                const auto receivedNs = TraceNow();
+                parent_->receivedBytes_.fetch_add(buffer.Length(), std::memory_order_relaxed);
+                if (ParseReply(buffer, reply))
+                {
+                    callback_(std::shared_ptr<const E>(reply), receivedNs);
+                }
+                else
+                {
+                    // As gRPC does: the next read fails.
+                    context.TryCancel();
+                }
             }
         case START:
             if (!ok)
@@ -171,8 +293,7 @@ public:
                 return;
             }
             callStatus = PROCESS;
-            reply.Clear();
-            responder->Read(&reply, this);
+            responder->Read(&buffer, this);
             break;
         case FINISH:
             delete this;
@@ -180,3 +301,187 @@ public:
         }
     }
 };
+
+
+// Flow-controlled variant of AsyncDownstreamingClientCall, see Fov::Credit: request,
+// carrying the window, is the first message of the stream, then the messages are granted
+// back as the callback returns, or as passed to IPublishSubscribeClient::GrantCredit if
+// manualCredit. C returns the number of messages it was called with. The replies are
+// read as is, as by AsyncDownstreamingClientCall.
+// Grants made while one is being written are coalesced into the next one.
+template<typename R, typename E, typename C>
+class AsyncCreditedClientCall : public ClientCallBase
+{
+    grpc::ClientContext context;
+    grpc::ByteBuffer buffer;
+    // Shared with the plain notifications referring to its image bytes.
+    std::shared_ptr<E> reply;
+    grpc::Status status{};
+    enum CallStatus { START, PROCESS, FINISH } callStatus;
+    std::unique_ptr< grpc::ClientAsyncReaderWriter<R, grpc::ByteBuffer> > stream;
+
+    ClientImpl* parent_;
+
+    C& callback_;
+    const bool manualCredit_;
+
+    // The writes, of the request then of the grants, complete on writer_.
+    struct Writer : ClientCallBase
+    {
+        AsyncCreditedClientCall* call;
+        void Proceed(bool ok) override { call->Written(ok); }
+    } writer_;
+
+    // Guarded by parent_->creditMutex_.
+    R outgoing_;
+    size_t numGranted_ = 0;
+    bool writing_ = false;
+    bool closed_ = false;
+    bool finished_ = false;
+
+public:
+    // method is the path of the bidirectional streaming method, see MethodPath.
+    AsyncCreditedClientCall(
+        const R& request,
+        ClientImpl* parent,
+        C& callback,
+        const std::string& method,
+        bool manualCredit
+    )
+    : parent_(parent)
+    , callback_(callback)
+    , manualCredit_(manualCredit)
+    , outgoing_(request)
+    {
+        writer_.call = this;
+        ++parent_->numCalls_;
+        {
+            std::lock_guard<std::mutex> locker(parent_->creditMutex_);
+            parent_->grantCredit_ = [this](size_t numMessages) { GrantLocked(numMessages); };
+            parent_->manualCredit_ = manualCredit_;
+        }
+        parent_->addContext(&context);
+        callStatus = START;
+        const grpc::internal::RpcMethod rpcMethod(method.c_str(), grpc::internal::RpcMethod::BIDI_STREAMING);
+        stream.reset(grpc::internal::ClientAsyncReaderWriterFactory<R, grpc::ByteBuffer>::Create(
+            parent_->channel_.get(), &parent_->cq_, rpcMethod, &context, true, this));
+    }
+    ~AsyncCreditedClientCall()
+    {
+        parent_->removeContext(&context);
+        --parent_->numCalls_;
+    }
+
+    void Proceed(bool ok = true) override
+    {
+        switch (callStatus)
+        {
+        case PROCESS:
+            if (ok)
+            {
+                const auto receivedNs = TraceNow();
+                parent_->receivedBytes_.fetch_add(buffer.Length(), std::memory_order_relaxed);
+                if (ParseReply(buffer, reply))
+                {
+                    const size_t numMessages = callback_(std::shared_ptr<const E>(reply), receivedNs);
+                    if (!manualCredit_)
+                    {
+                        std::lock_guard<std::mutex> locker(parent_->creditMutex_);
+                        GrantLocked(numMessages);
+                    }
+                }
+                else
+                {
+                    // As gRPC does: the next read fails.
+                    context.TryCancel();
+                }
+            }
+            // falls through
+        case START:
+            if (!ok)
+            {
+                {
+                    std::lock_guard<std::mutex> locker(parent_->creditMutex_);
+                    closed_ = true;
+                }
+                stream->Finish(&status, this);
+                gpr_log(GPR_INFO, "Status code: %d, message: \"%s\", details: \"%s\"",
+                    status.error_code(), status.error_message().c_str(), status.error_details().c_str());
+                callStatus = FINISH;
+                return;
+            }
+            if (callStatus == START)
+            {
+                std::lock_guard<std::mutex> locker(parent_->creditMutex_);
+                writing_ = true;
+                stream->Write(outgoing_, &writer_);
+            }
+            callStatus = PROCESS;
+            stream->Read(&buffer, this);
+            break;
+        case FINISH:
+            {
+                std::lock_guard<std::mutex> locker(parent_->creditMutex_);
+                finished_ = true;
+                if (!Unregister())
+                {
+                    // Written deletes the call.
+                    return;
+                }
+            }
+            delete this;
+            break;
+        }
+    }
+
+private:
+    void GrantLocked(size_t numMessages)
+    {
+        if (closed_)
+        {
+            return;
+        }
+        numGranted_ += numMessages;
+        if (!writing_ && numGranted_ > 0)
+        {
+            WriteGrantLocked();
+        }
+    }
+
+    void WriteGrantLocked()
+    {
+        outgoing_.Clear();
+        outgoing_.mutable_credit()->set_granted(static_cast<uint32_t>(numGranted_));
+        numGranted_ = 0;
+        writing_ = true;
+        stream->Write(outgoing_, &writer_);
+    }
+
+    void Written(bool ok)
+    {
+        {
+            std::lock_guard<std::mutex> locker(parent_->creditMutex_);
+            writing_ = false;
+            if (ok && !closed_ && numGranted_ > 0)
+            {
+                WriteGrantLocked();
+            }
+            if (!finished_ || !Unregister())
+            {
+                return;
+            }
+        }
+        delete this;
+    }
+
+    // Whether the call may be deleted, which nothing refers to from now on if so.
+    bool Unregister()
+    {
+        if (writing_)
+        {
+            return false;
+        }
+        parent_->grantCredit_ = nullptr;
+        return true;
+    }
+};
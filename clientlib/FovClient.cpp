@@ -1,9 +1,17 @@
 #include "FovClient.h"
 
+#include "CallbackDispatcher.h"
 #include "ClientImpl.h"
+#include "lrumap.h"
 
 #include "Fov.grpc.pb.h"
 
+#include <zlib.h>
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
 
 
 namespace {
@@ -12,52 +20,343 @@ namespace {
 #define MOVE_STUFF_MACRO(type, name) result.name = src.name();
 #define MOVE_STUFF_PTR_MACRO(type, name) pResult->name = src.name();
 
-auto AsPlainFoiImage(const Fov::Image& src)
+// Deflate shrinks data by 1032:1 at most, so a larger raw_size cannot be right.
+enum { kMaxDeflateRatio = 1032 };
+// Images are not larger than that once inflated, whatever their raw_size says.
+const size_t kMaxImageSize = 256 * 1024 * 1024;
+
+SharedBuffer Decode(const Fov::Image& src)
+{
+    // raw_size comes from the peer, so it is checked before anything is allocated.
+    if (src.codec() == Fov::CODEC_DEFLATE && src.raw_size() <= kMaxImageSize
+        && src.raw_size() <= static_cast<uint64_t>(src.data().size()) * kMaxDeflateRatio)
+    {
+        std::vector<char> result(src.raw_size());
+        auto size = static_cast<uLongf>(result.size());
+        if (uncompress(reinterpret_cast<Bytef*>(result.data()), &size,
+                reinterpret_cast<const Bytef*>(src.data().data()), static_cast<uLong>(src.data().size())) == Z_OK
+            && size == result.size())
+        {
+            return result;
+        }
+    }
+    gpr_log(GPR_ERROR, "Could not decode an image, codec: %d", static_cast<int>(src.codec()));
+    return {};
+}
+
+// The texts of the labels of a stream by id, see Fov::Label.
+class LabelDictionary
+{
+public:
+    void define(const google::protobuf::RepeatedPtrField<Fov::Label>& labels)
+    {
+        for (const auto& v : labels)
+        {
+            texts_[v.id()] = v.text();
+        }
+    }
+
+    // The text is used as is by servers not sending ids.
+    InternedString get(uint32_t id, const InternedString& text) const
+    {
+        if (id == 0)
+        {
+            return text;
+        }
+        const auto it = texts_.find(id);
+        if (it == texts_.end())
+        {
+            gpr_log(GPR_ERROR, "Undefined label id: %u", id);
+            return {};
+        }
+        return it->second;
+    }
+
+private:
+    // Ids come from the peer: a map takes no more room than the labels defined,
+    // whatever their values.
+    std::unordered_map<uint32_t, InternedString> texts_;
+};
+
+// The image bytes stay in the received message, which owner keeps alive, unless encoded.
+auto AsPlainFoiImage(const Fov::Image& src, const std::shared_ptr<const void>& owner)
 {
     auto pResult = std::make_shared<PlainFoiImage>();
     FOI_IMAGE_X(MOVE_STUFF_PTR_MACRO)
-    pResult->data = { src.data().begin(), src.data().end() };
+    if (src.codec() == Fov::CODEC_NONE)
+    {
+        pResult->data = { src.data().data(), src.data().size(), owner };
+    }
+    else
+    {
+        pResult->data = Decode(src);
+    }
     return pResult;
 }
 
-auto AsPlainFoiObject(const Fov::Object& src)
+auto AsPlainFoiObject(const Fov::Object& src, const LabelDictionary& labels)
 {
     PlainFoiObject result;
     FOI_OBJECT_X(MOVE_STUFF_MACRO)
+    result.label = labels.get(src.label_id(), result.label);
     return result;
 }
 
-auto AsPlain(const Fov::Event& src)
+// Labels defined by the reply are added to labels.
+auto AsPlain(const std::shared_ptr<const Fov::Event>& reply, LabelDictionary& labels)
 {
+    const auto& src = *reply;
+    labels.define(src.labels());
+
     PlainFoiEvent result;
     FOI_EVENT_X(MOVE_STUFF_MACRO)
 
-    result.image = AsPlainFoiImage(src.image());
+    result.image = AsPlainFoiImage(src.image(), reply);
 
     for (int i = 0; i < src.objects_size(); ++i)
     {
-        result.objects.push_back(AsPlainFoiObject(src.objects(i)));
+        result.objects.push_back(AsPlainFoiObject(src.objects(i), labels));
     }
 
     return result;
 }
 
-auto AsPlain(const Fov::Notify& src)
+auto AsPlain(const std::shared_ptr<const Fov::Notify>& reply, LabelDictionary& labels)
 {
+    const auto& src = *reply;
+    labels.define(src.labels());
+
     PlainFoiNotify result;
     FOI_NOTIFY_X(MOVE_STUFF_MACRO)
+    result.category = labels.get(src.category_id(), result.category);
 
     for (int i = 0; i < src.images_size(); ++i)
     {
-        result.images.push_back(AsPlainFoiImage(src.images(i)));
+        result.images.push_back(AsPlainFoiImage(src.images(i), reply));
     }
 
     return result;
 }
 
+// Applies delta to the objects of the previous event, see Fov::ObjectDelta.
+void ApplyObjectDelta(const Fov::ObjectDelta& delta, const LabelDictionary& labels, std::vector<PlainFoiObject>& objects)
+{
+    const std::unordered_set<uint64_t> removedIds(delta.removed_ids().begin(), delta.removed_ids().end());
+    objects.erase(std::remove_if(objects.begin(), objects.end(),
+        [&removedIds](const PlainFoiObject& v) { return removedIds.count(v.id) != 0; }), objects.end());
+
+    std::unordered_map<uint64_t, size_t> indices;
+    for (size_t i = 0; i < objects.size(); ++i)
+    {
+        indices.emplace(objects[i].id, i);
+    }
+    for (const auto& v : delta.upserted())
+    {
+        const auto it = indices.find(v.id());
+        if (it != indices.end())
+        {
+            objects[it->second] = AsPlainFoiObject(v, labels);
+        }
+        else
+        {
+            objects.push_back(AsPlainFoiObject(v, labels));
+        }
+    }
+}
+
 #undef MOVE_STUFF_PTR_MACRO
 #undef MOVE_STUFF_MACRO
 
+// Records the stages of reply, the server ones included, once delivered.
+template<typename T>
+void RecordTrace(TraceHistograms& histograms, const T& reply, uint64_t receivedNs, uint64_t parsedNs)
+{
+    TraceStamps stamps;
+    stamps[TraceStage::PUSHED] = reply.trace().pushed_ns();
+    stamps[TraceStage::SERIALIZED] = reply.trace().serialized_ns();
+    stamps[TraceStage::DEQUEUED] = reply.trace().dequeued_ns();
+    stamps[TraceStage::RECEIVED] = receivedNs;
+    stamps[TraceStage::PARSED] = parsedNs;
+    stamps[TraceStage::DELIVERED] = TraceNow();
+    histograms.record(stamps);
+}
+
+// Whether the subscription is flow controlled, see Fov::Credit.
+bool IsCredited(const SubscribeOptions& options)
+{
+    return options.creditMessages != 0 || options.creditBytes != 0;
+}
+
+// Calls the callback of a receiver right away, or through a CallbackDispatcher if the
+// options ask for callback threads, in which case the credit of the flow-controlled
+// calls is granted back once the callback returns.
+class Delivery
+{
+public:
+    Delivery(ClientImpl& client, const SubscribeOptions& options)
+        : client_(client)
+        , ordering_(options.callbackOrdering)
+        , grantsBack_(!options.manualCredit)
+    {
+        if (options.callbackThreads > 0 || options.callbackExecutor)
+        {
+            dispatcher_ = std::make_unique<CallbackDispatcher>(
+                options.callbackThreads, options.callbackExecutor, options.maxPendingCallbacks);
+        }
+    }
+
+    template<typename T>
+    uint64_t key(const T& message) const
+    {
+        return (ordering_ == CallbackOrdering::SDU_ID) ? message.sdu_id : std::hash<std::string>{}(message.fov_id);
+    }
+
+    // Returns the number of messages the callback is done with already, see AsyncCreditedClientCall.
+    template<typename F>
+    size_t operator()(uint64_t key, F&& deliver)
+    {
+        if (!dispatcher_)
+        {
+            deliver();
+            return 1;
+        }
+        dispatcher_->post(key, [this, deliver = std::forward<F>(deliver)] {
+            deliver();
+            if (grantsBack_)
+            {
+                client_.grantCredit(1);
+            }
+        });
+        return 0;
+    }
+
+private:
+    ClientImpl& client_;
+    const CallbackOrdering ordering_;
+    const bool grantsBack_;
+    // Waits for the callbacks when destroyed.
+    std::unique_ptr<CallbackDispatcher> dispatcher_;
+};
+
+
+// Passes the events on to the callback, one at a time, rebuilding the objects of
+// those sent as deltas out of the previous event of the same fov_id. The server
+// only sends deltas for the fov_ids still kept, see OBJECT_DELTA_MAX_STREAMS.
+class EventReceiver
+{
+public:
+    // The metrics of client are updated.
+    EventReceiver(PublishSubscribeClientCallback callback, const SubscribeOptions& options, ClientImpl& client)
+        : callback_(std::move(callback)), objectDeltas_(options.objectDeltas), client_(client)
+        , trace_(client.traceHistograms_.get()), delivery_(client, options)
+    {
+    }
+
+    // Returns the number of events passed on.
+    size_t operator()(const std::shared_ptr<const Fov::Event>& reply, uint64_t receivedNs)
+    {
+        auto event = AsPlain(reply, labels_);
+        if (objectDeltas_)
+        {
+            bool found;
+            auto& objects = objects_.touch(event.fov_id, found);
+            client_.objectDeltaStreams_.store(objects_.size(), std::memory_order_relaxed);
+            if (reply->has_object_delta())
+            {
+                ApplyObjectDelta(reply->object_delta(), labels_, objects);
+                event.objects = objects;
+            }
+            else
+            {
+                objects = event.objects;
+            }
+        }
+        const auto parsedNs = TraceNow();
+        client_.parseTimes_.record(parsedNs - receivedNs);
+        client_.receivedMessages_.fetch_add(1, std::memory_order_relaxed);
+        const auto key = delivery_.key(event);
+        return delivery_(key, [this, event = std::move(event), reply, receivedNs, parsedNs] {
+            callback_(event);
+            if (trace_)
+            {
+                RecordTrace(*trace_, *reply, receivedNs, parsedNs);
+            }
+        });
+    }
+
+    // The events refer to the batch they come from.
+    size_t operator()(const std::shared_ptr<const Fov::EventBatch>& reply, uint64_t receivedNs)
+    {
+        size_t result = 0;
+        for (const auto& v : reply->events())
+        {
+            result += (*this)(std::shared_ptr<const Fov::Event>(reply, &v), receivedNs);
+        }
+        return result;
+    }
+
+private:
+    PublishSubscribeClientCallback callback_;
+    LabelDictionary labels_;
+    const bool objectDeltas_;
+    // The objects of the last event per fov_id.
+    LruMap<std::string, std::vector<PlainFoiObject>> objects_{ OBJECT_DELTA_MAX_STREAMS };
+    ClientImpl& client_;
+    // Null unless the events are traced.
+    TraceHistograms* const trace_;
+    // Last, so that the callbacks are done before the rest is destroyed.
+    Delivery delivery_;
+};
+
+// Passes the notifications on to the callback, one at a time.
+class NotifyReceiver
+{
+public:
+    // The metrics of client are updated.
+    NotifyReceiver(NotifyClientCallback callback, const SubscribeOptions& options, ClientImpl& client)
+        : callback_(std::move(callback)), client_(client), trace_(client.traceHistograms_.get())
+        , delivery_(client, options)
+    {
+    }
+
+    // Returns the number of notifications passed on.
+    size_t operator()(const std::shared_ptr<const Fov::Notify>& reply, uint64_t receivedNs)
+    {
+        auto notification = AsPlain(reply, labels_);
+        const auto parsedNs = TraceNow();
+        client_.parseTimes_.record(parsedNs - receivedNs);
+        client_.receivedMessages_.fetch_add(1, std::memory_order_relaxed);
+        const auto key = delivery_.key(notification);
+        return delivery_(key, [this, notification = std::move(notification), reply, receivedNs, parsedNs] {
+            callback_(notification);
+            if (trace_)
+            {
+                RecordTrace(*trace_, *reply, receivedNs, parsedNs);
+            }
+        });
+    }
+
+    // The notifications refer to the batch they come from.
+    size_t operator()(const std::shared_ptr<const Fov::NotifyBatch>& reply, uint64_t receivedNs)
+    {
+        size_t result = 0;
+        for (const auto& v : reply->notifications())
+        {
+            result += (*this)(std::shared_ptr<const Fov::Notify>(reply, &v), receivedNs);
+        }
+        return result;
+    }
+
+private:
+    NotifyClientCallback callback_;
+    LabelDictionary labels_;
+    ClientImpl& client_;
+    // Null unless the notifications are traced.
+    TraceHistograms* const trace_;
+    // Last, so that the callbacks are done before the rest is destroyed.
+    Delivery delivery_;
+};
+
 
 //////////////////////////////////////////////////////////////////////////////
 
@@ -66,9 +365,21 @@ auto AsPlain(const Fov::Notify& src)
 
 // AsyncDownstreamingClientCall
 
-using EventClientCall = AsyncDownstreamingClientCall<Fov::Event, PublishSubscribeClientCallback>;
+using EventClientCall = AsyncDownstreamingClientCall<Fov::Event, EventReceiver>;
+
+using NotifyClientCall = AsyncDownstreamingClientCall<Fov::Notify, NotifyReceiver>;
+
+using EventBatchClientCall = AsyncDownstreamingClientCall<Fov::EventBatch, EventReceiver>;
+
+using NotifyBatchClientCall = AsyncDownstreamingClientCall<Fov::NotifyBatch, NotifyReceiver>;
+
+using EventCreditedClientCall = AsyncCreditedClientCall<Fov::EventChannel, Fov::Event, EventReceiver>;
+
+using NotifyCreditedClientCall = AsyncCreditedClientCall<Fov::NotifyChannel, Fov::Notify, NotifyReceiver>;
 
-using NotifyClientCall = AsyncDownstreamingClientCall<Fov::Notify, NotifyClientCallback>;
+using EventBatchCreditedClientCall = AsyncCreditedClientCall<Fov::EventChannel, Fov::EventBatch, EventReceiver>;
+
+using NotifyBatchCreditedClientCall = AsyncCreditedClientCall<Fov::NotifyChannel, Fov::NotifyBatch, NotifyReceiver>;
 
 
 class PublishSubscribeClient : public ClientImpl
@@ -76,24 +387,47 @@ class PublishSubscribeClient : public ClientImpl
 public:
     explicit PublishSubscribeClient(
         const std::string& targetIpAddress,
-        PublishSubscribeClientCallback callback)
-        : ClientImpl(targetIpAddress)
-        , stub_(Fov::EventSubscriber::NewStub(channel_))
-        , callback_(std::move(callback))
+        PublishSubscribeClientCallback callback,
+        const SubscribeOptions& options)
+        : ClientImpl(targetIpAddress, options.trace)
+        , receiver_(std::move(callback), options, *this)
     {
     }
 
-    void RequestNotification(const Fov::EventChannel& id)
+    ~PublishSubscribeClient() override
     {
-        new EventClientCall(id, this, callback_, stub_);
+        Stop();
     }
 
-private:
-    // Out of the passed in Channel comes the stub, stored here, our view of the
-    // server"s exposed services.
-    std::unique_ptr<Fov::EventSubscriber::Stub> stub_;
+    void RequestNotification(const Fov::EventChannel& id, const SubscribeOptions& options)
+    {
+        const bool batched = options.batched;
+        if (IsCredited(options))
+        {
+            if (batched)
+            {
+                new EventBatchCreditedClientCall(id, this, receiver_,
+                    MethodPath<Fov::EventSubscriber>("SubscribeBatchWithCredit"), options.manualCredit);
+            }
+            else
+            {
+                new EventCreditedClientCall(id, this, receiver_,
+                    MethodPath<Fov::EventSubscriber>("SubscribeWithCredit"), options.manualCredit);
+            }
+        }
+        else if (batched)
+        {
+            new EventBatchClientCall(id, this, receiver_, MethodPath<Fov::EventSubscriber>("SubscribeBatch"));
+        }
+        else
+        {
+            new EventClientCall(id, this, receiver_, MethodPath<Fov::EventSubscriber>("Subscribe"));
+        }
+    }
 
-    PublishSubscribeClientCallback callback_;
+private:
+    // Only used by the completion queue thread.
+    EventReceiver receiver_;
 };
 
 class NotifyClient : public ClientImpl
@@ -101,50 +435,100 @@ class NotifyClient : public ClientImpl
 public:
     explicit NotifyClient(
         const std::string& targetIpAddress,
-        NotifyClientCallback callback)
-        : ClientImpl(targetIpAddress)
-        , stub_(Fov::NotifySubscriber::NewStub(channel_))
-        , callback_(std::move(callback))
+        NotifyClientCallback callback,
+        const SubscribeOptions& options)
+        : ClientImpl(targetIpAddress, options.trace)
+        , receiver_(std::move(callback), options, *this)
     {
     }
 
-    void RequestNotification(const Fov::NotifyChannel& id)
+    ~NotifyClient() override
     {
-        new NotifyClientCall(id, this, callback_, stub_);
+        Stop();
     }
 
-private:
-    // Out of the passed in Channel comes the stub, stored here, our view of the
-    // server"s exposed services.
-    std::unique_ptr<Fov::NotifySubscriber::Stub> stub_;
+    void RequestNotification(const Fov::NotifyChannel& id, const SubscribeOptions& options)
+    {
+        const bool batched = options.batched;
+        if (IsCredited(options))
+        {
+            if (batched)
+            {
+                new NotifyBatchCreditedClientCall(id, this, receiver_,
+                    MethodPath<Fov::NotifySubscriber>("SubscribeBatchWithCredit"), options.manualCredit);
+            }
+            else
+            {
+                new NotifyCreditedClientCall(id, this, receiver_,
+                    MethodPath<Fov::NotifySubscriber>("SubscribeWithCredit"), options.manualCredit);
+            }
+        }
+        else if (batched)
+        {
+            new NotifyBatchClientCall(id, this, receiver_, MethodPath<Fov::NotifySubscriber>("SubscribeBatch"));
+        }
+        else
+        {
+            new NotifyClientCall(id, this, receiver_, MethodPath<Fov::NotifySubscriber>("Subscribe"));
+        }
+    }
 
-    NotifyClientCallback callback_;
+private:
+    NotifyReceiver receiver_;
 };
 
 
+template<typename T>
+void SetSubscribeOptions(T& request, const SubscribeOptions& options)
+{
+    for (const auto& v : options.fovIds)
+    {
+        request.add_fov_ids(v);
+    }
+    for (auto v : options.sduIds)
+    {
+        request.add_sdu_ids(v);
+    }
+    request.set_image_codec(static_cast<Fov::Codec>(options.imageCodec));
+    request.set_gzip(options.gzip);
+    request.set_image_scale(static_cast<Fov::ImageScale>(options.imageScale));
+    request.set_image_quality(static_cast<Fov::ImageQuality>(options.imageQuality));
+    request.set_object_deltas(options.objectDeltas);
+    request.set_trace(options.trace);
+    if (IsCredited(options))
+    {
+        request.mutable_credit()->set_messages(options.creditMessages);
+        request.mutable_credit()->set_bytes(options.creditBytes);
+    }
+}
+
 } // namespace
 
 std::unique_ptr<IPublishSubscribeClient> MakePublishSubscribeClient(
-    const std::string& targetIpAddress, const std::string& id, const PublishSubscribeClientCallback& callback)
+    const std::string& targetIpAddress, const std::string& id, const PublishSubscribeClientCallback& callback,
+    const SubscribeOptions& options)
 {
-    auto result = std::make_unique<PublishSubscribeClient>(targetIpAddress, callback);
+    auto result = std::make_unique<PublishSubscribeClient>(targetIpAddress, callback, options);
 
     Fov::EventChannel request;
     request.set_id(id);
-    result->RequestNotification(request);
+    SetSubscribeOptions(request, options);
+    result->RequestNotification(request, options);
     result->RunAsync();
 
     return result;
 }
 
 std::unique_ptr<IPublishSubscribeClient> MakeNotifyClient(
-    const std::string& targetIpAddress, const std::string& id, const NotifyClientCallback& callback)
+    const std::string& targetIpAddress, const std::string& id, const NotifyClientCallback& callback,
+    const SubscribeOptions& options)
 {
-    auto result = std::make_unique<NotifyClient>(targetIpAddress, callback);
+    auto result = std::make_unique<NotifyClient>(targetIpAddress, callback, options);
 
     Fov::NotifyChannel request;
     request.set_id(id);
-    result->RequestNotification(request);
+    SetSubscribeOptions(request, options);
+    result->RequestNotification(request, options);
     result->RunAsync();
 
     return result;
@@ -9,27 +9,89 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 
 using PublishSubscribeClientCallback = std::function<void (const PlainFoiEvent &)>;
 using NotifyClientCallback = std::function<void(const PlainFoiNotify &)>;
 
+/// Runs the functions it is passed, for instance on a thread pool of the application
+using CallbackExecutor = std::function<void(std::function<void()>)>;
+
+/*!
+ * \brief Which messages are passed to the callback in order, when several threads call it
+ */
+enum class CallbackOrdering
+{
+    FOV_ID, ///< those of the same fov_id
+    SDU_ID  ///< those of the same sdu_id
+};
+
+/*!
+ * \brief The SubscribeOptions struct
+ */
+struct SubscribeOptions
+{
+    /// Only receive the messages of these fov_ids; all of them if empty
+    std::vector<std::string> fovIds;
+    /// Only receive the messages of these sdu_ids; all of them if empty
+    std::vector<uint64_t> sduIds;
+    /// Receive several messages at a time when they queue up, which is cheaper for small ones
+    bool batched = false;
+    /// How the server encodes the images, once for all the subscribers asking for the same
+    ImageCodec imageCodec = ImageCodec::NONE;
+    /// Have gRPC compress the whole messages, separately for each subscriber
+    bool gzip = false;
+    /// Resolution of the images, scaled down by the server once for all the subscribers asking for the same
+    ImageScale imageScale = ImageScale::FULL;
+    /// JPEG quality of the images, if re-encoded
+    ImageQuality imageQuality = ImageQuality::ORIGINAL;
+    /// Receive the objects of the events as deltas against the previous event of the same fov_id;
+    /// the full objects are rebuilt before the callback is called
+    bool objectDeltas = false;
+    /// Have the messages stamped at each stage from Push to the callback,
+    /// see IPublishSubscribeClient::GetTraceHistograms
+    bool trace = false;
+    /// Flow control: at most creditMessages messages and creditBytes bytes are received ahead of
+    /// the consumer, 0 for no limit; the others wait on the server under its overflow policy.
+    /// The limits are off if both are 0
+    uint32_t creditMessages = 0;
+    uint64_t creditBytes = 0;
+    /// The consumer is done with the messages once passed to IPublishSubscribeClient::GrantCredit,
+    /// rather than when the callback returns, for callbacks handing them over to other threads
+    bool manualCredit = false;
+    /// Number of threads calling the callback, which may then be called concurrently for messages
+    /// of different keys, see callbackOrdering; 0 to call it from the thread receiving the messages
+    size_t callbackThreads = 0;
+    /// Runs the callbacks instead of callbackThreads threads if set; it must run every function
+    /// it is passed, the client waiting for them when destroyed
+    CallbackExecutor callbackExecutor;
+    /// The messages of the same key are passed in order, one at a time
+    CallbackOrdering callbackOrdering = CallbackOrdering::FOV_ID;
+    /// Maximum number of messages waiting for the callback threads, beyond which receiving waits
+    size_t maxPendingCallbacks = 100;
+};
+
 /*!
  * \brief MakePublishSubscribeClient
  * \param targetIpAddress The URI of the endpoint to connect to.
  * \param id
  * \param callback a PublishSubscribeClientCallback instance
+ * \param options a SubscribeOptions instance
  * \return
  */
 std::unique_ptr<IPublishSubscribeClient> MakePublishSubscribeClient(
-    const std::string& targetIpAddress, const std::string& id, const PublishSubscribeClientCallback& callback);
+    const std::string& targetIpAddress, const std::string& id, const PublishSubscribeClientCallback& callback,
+    const SubscribeOptions& options = {});
 
 /*!
  * \brief MakeNotifyClient
  * \param targetIpAddress The URI of the endpoint to connect to.
  * \param id
  * \param callback a NotifyClientCallback instance
+ * \param options a SubscribeOptions instance
  * \return
  */
 std::unique_ptr<IPublishSubscribeClient> MakeNotifyClient(
-    const std::string& targetIpAddress, const std::string& id, const NotifyClientCallback& callback);
+    const std::string& targetIpAddress, const std::string& id, const NotifyClientCallback& callback,
+    const SubscribeOptions& options = {});
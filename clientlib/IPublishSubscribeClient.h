@@ -1,5 +1,10 @@
 #pragma once
 
+#include "metrics.h"
+#include "tracing.h"
+
+#include <cstddef>
+
 /*!
  * \brief The IPublishSubscribeClient interface
  */
@@ -30,4 +35,22 @@ struct IPublishSubscribeClient
      * \return
      */
     virtual connectivity_state GetConnectionState(bool try_to_connect) = 0;
+    /*!
+     * \brief GetTraceHistograms
+     * \return the time the messages took reaching each stage, from Push to the callback,
+     * or nullptr unless SubscribeOptions::trace
+     */
+    virtual const TraceHistograms* GetTraceHistograms() const = 0;
+    /*!
+     * \brief GetMetrics
+     * \return a snapshot of the counters of the client; may be called from any thread
+     */
+    virtual ClientMetrics GetMetrics() const = 0;
+    /*!
+     * \brief GrantCredit lets the server send more messages, see SubscribeOptions::manualCredit
+     *
+     * Ignored unless the credit is granted manually. May be called from any thread.
+     * \param numMessages the number of messages delivered to the callback the consumer is done with
+     */
+    virtual void GrantCredit(size_t numMessages) = 0;
 };
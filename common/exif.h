@@ -0,0 +1,55 @@
+#pragma once
+
+/// @file
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/*!
+ * \brief ReadExifOrientation reads the orientation tag of an EXIF APP1 segment
+ * \param p the segment payload, starting with "Exif\0\0", its length excluded
+ * \param size the size of the payload
+ * \return the orientation, 1 (upright) if missing or unreadable, between 5 and 8 if
+ *         the image is transposed or rotated by 90 degrees
+ */
+inline int ReadExifOrientation(const unsigned char* p, size_t size)
+{
+    enum { kHeaderSize = 6, kOrientationTag = 0x0112 };
+    if (size < kHeaderSize + 8 || std::memcmp(p, "Exif", 4) != 0)
+    {
+        return 1;
+    }
+    const unsigned char* tiff = p + kHeaderSize;
+    const size_t tiffSize = size - kHeaderSize;
+
+    const bool isLittleEndian = tiff[0] == 'I';
+    auto read = [tiff, isLittleEndian](size_t offset, size_t numBytes) {
+        uint32_t result = 0;
+        for (size_t i = 0; i < numBytes; ++i)
+        {
+            result |= static_cast<uint32_t>(tiff[offset + i]) << (8 * (isLittleEndian ? i : numBytes - 1 - i));
+        }
+        return result;
+    };
+
+    const size_t ifd = read(4, 4);
+    if (ifd + 2 > tiffSize)
+    {
+        return 1;
+    }
+    const size_t numEntries = read(ifd, 2);
+    for (size_t i = 0; i < numEntries; ++i)
+    {
+        const size_t entry = ifd + 2 + i * 12;
+        if (entry + 12 > tiffSize)
+        {
+            break;
+        }
+        if (read(entry, 2) == kOrientationTag)
+        {
+            return static_cast<int>(read(entry + 8, 2));
+        }
+    }
+    return 1;
+}
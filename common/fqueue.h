@@ -2,6 +2,7 @@
 
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <queue>
 #include <type_traits>
 
@@ -81,7 +82,7 @@ public:
 
     bool empty()
     {
-        boost::lock_guard<boost::mutex> locker(m_mutex);
+        std::lock_guard<std::mutex> locker(m_mutex);
         return m_queue.empty();
     }
 
@@ -0,0 +1,98 @@
+#pragma once
+
+/// @file
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+/*!
+ * \brief The InternedString class is a handle to a string stored once per process
+ *
+ * Copying it costs a pointer copy. Interned strings are never freed, so it is meant
+ * for small vocabularies, such as object labels and categories.
+ */
+class InternedString
+{
+public:
+    /*!
+     * \brief The empty string, whose id is 0
+     */
+    InternedString() : entry_(&pool().empty) {}
+
+    InternedString(const std::string& text) : entry_(pool().intern(text)) {}
+
+    InternedString(const char* text) : entry_(pool().intern(text)) {}
+
+    const std::string& str() const { return entry_->text; }
+    operator const std::string&() const { return entry_->text; }
+    const char* c_str() const { return entry_->text.c_str(); }
+    bool empty() const { return entry_->text.empty(); }
+
+    /*!
+     * \brief Small number identifying the string within the process, in order of interning
+     */
+    uint32_t id() const { return entry_->id; }
+
+    friend bool operator==(const InternedString& a, const InternedString& b)
+    {
+        // Modules may have pools of their own.
+        return a.entry_ == b.entry_ || a.entry_->text == b.entry_->text;
+    }
+    friend bool operator!=(const InternedString& a, const InternedString& b) { return !(a == b); }
+
+private:
+    struct Entry
+    {
+        std::string text;
+        uint32_t id;
+    };
+
+    class Pool
+    {
+    public:
+        const Entry* intern(const std::string& text)
+        {
+            if (text.empty())
+            {
+                return &empty;
+            }
+            {
+                std::shared_lock<std::shared_mutex> locker(mutex_);
+                const auto it = byText_.find(text);
+                if (it != byText_.end())
+                {
+                    return it->second;
+                }
+            }
+            std::unique_lock<std::shared_mutex> locker(mutex_);
+            auto& result = byText_[text];
+            if (!result)
+            {
+                entries_.push_back({ text, static_cast<uint32_t>(entries_.size() + 1) });
+                result = &entries_.back();
+            }
+            return result;
+        }
+
+        const Entry empty{ std::string(), 0 };
+
+    private:
+        std::shared_mutex mutex_;
+        std::unordered_map<std::string, const Entry*> byText_;
+        // Never reallocated, so that handles stay valid.
+        std::deque<Entry> entries_;
+    };
+
+    static Pool& pool()
+    {
+        // Never destroyed, for the handles held by static objects.
+        static Pool* instance = new Pool;
+        return *instance;
+    }
+
+    const Entry* entry_;
+};
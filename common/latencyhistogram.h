@@ -0,0 +1,176 @@
+#pragma once
+
+/// @file
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*!
+ * \brief The LatencyHistogram class counts durations in log-linear buckets, HDR histogram style
+ *
+ * Values are kept with 2 significant decimal digits (1/64 relative precision) from 0 up to
+ * about 18 minutes in nanoseconds; larger ones are counted in the last bucket. Recording
+ * takes no lock and may happen from any number of threads while others read.
+ */
+class LatencyHistogram
+{
+public:
+    LatencyHistogram()
+    {
+        reset();
+    }
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(uint64_t value)
+    {
+        counts_[indexOf(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        lower(min_, value);
+        raise(max_, value);
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+    /*!
+     * \brief Sum of the recorded values
+     */
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+
+    /*!
+     * \brief Smallest recorded value, 0 if none
+     */
+    uint64_t min() const { return count() ? min_.load(std::memory_order_relaxed) : 0; }
+
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    double mean() const
+    {
+        const auto n = count();
+        return n ? static_cast<double>(sum_.load(std::memory_order_relaxed)) / n : 0.;
+    }
+
+    /*!
+     * \brief Value at or below which percent percent of the recorded values are, 0 if none
+     * \param percent between 0 and 100
+     */
+    uint64_t percentile(double percent) const
+    {
+        const auto n = count();
+        if (n == 0)
+        {
+            return 0;
+        }
+        const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::min(percent, 100.) / 100. * n + 0.5));
+        uint64_t cumulated = 0;
+        for (size_t i = 0; i < kNumBuckets; ++i)
+        {
+            cumulated += counts_[i].load(std::memory_order_relaxed);
+            if (cumulated >= rank)
+            {
+                // The last bucket also holds the values out of range.
+                return (i == kNumBuckets - 1) ? max() : std::min(highestValueOf(i), max());
+            }
+        }
+        return max();
+    }
+
+    /*!
+     * \brief Records the values recorded by other, for instance to combine those of several threads
+     */
+    void add(const LatencyHistogram& other)
+    {
+        for (size_t i = 0; i < kNumBuckets; ++i)
+        {
+            counts_[i].fetch_add(other.counts_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        count_.fetch_add(other.count(), std::memory_order_relaxed);
+        sum_.fetch_add(other.sum_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        lower(min_, other.min_.load(std::memory_order_relaxed));
+        raise(max_, other.max());
+    }
+
+    /*!
+     * \brief Forgets the recorded values; not atomic with respect to concurrent records
+     */
+    void reset()
+    {
+        for (auto& v : counts_)
+        {
+            v.store(0, std::memory_order_relaxed);
+        }
+        count_ = 0;
+        sum_ = 0;
+        min_ = UINT64_MAX;
+        max_ = 0;
+    }
+
+private:
+    // Values below kSubBuckets have a bucket each; above, each power of 2 is split into
+    // kSubBuckets / 2 buckets.
+    enum { kSubBucketBits = 7, kSubBuckets = 1 << kSubBucketBits, kHalfSubBuckets = kSubBuckets / 2 };
+    enum { kMaxValueBits = 40, kNumBuckets = kSubBuckets + (kMaxValueBits - kSubBucketBits) * kHalfSubBuckets };
+
+    static void lower(std::atomic<uint64_t>& target, uint64_t value)
+    {
+        for (auto current = target.load(std::memory_order_relaxed);
+            value < current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed);)
+        {
+        }
+    }
+
+    static void raise(std::atomic<uint64_t>& target, uint64_t value)
+    {
+        for (auto current = target.load(std::memory_order_relaxed);
+            value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed);)
+        {
+        }
+    }
+
+    static unsigned bitWidth(uint64_t value)
+    {
+#if defined(__GNUC__)
+        return value ? 64 - __builtin_clzll(value) : 0;
+#else
+        unsigned result = 0;
+        for (; value; value >>= 1)
+        {
+            ++result;
+        }
+        return result;
+#endif
+    }
+
+    static size_t indexOf(uint64_t value)
+    {
+        if (value < kSubBuckets)
+        {
+            return static_cast<size_t>(value);
+        }
+        const unsigned shift = bitWidth(value) - kSubBucketBits;
+        const size_t index = kSubBuckets + (shift - 1) * kHalfSubBuckets + ((value >> shift) - kHalfSubBuckets);
+        return std::min<size_t>(index, kNumBuckets - 1);
+    }
+
+    static uint64_t highestValueOf(size_t index)
+    {
+        if (index < kSubBuckets)
+        {
+            return index;
+        }
+        const unsigned shift = static_cast<unsigned>((index - kSubBuckets) / kHalfSubBuckets + 1);
+        const uint64_t subBucket = (index - kSubBuckets) % kHalfSubBuckets + kHalfSubBuckets;
+        return ((subBucket + 1) << shift) - 1;
+    }
+
+    std::array<std::atomic<uint64_t>, kNumBuckets> counts_;
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> min_;
+    std::atomic<uint64_t> max_;
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+// Map holding at most capacity entries, the least recently touched one being
+// evicted to make room. Not thread-safe.
+
+template<typename K, typename V>
+class LruMap
+{
+public:
+    explicit LruMap(size_t capacity) : m_capacity(capacity > 0 ? capacity : 1) {}
+
+    // Returns the value of key, marked as the most recently touched; found tells
+    // whether it was there, a default one being inserted otherwise.
+    V& touch(const K& key, bool& found)
+    {
+        const auto it = m_index.find(key);
+        found = it != m_index.end();
+        if (found)
+        {
+            m_entries.splice(m_entries.begin(), m_entries, it->second);
+            return it->second->second;
+        }
+
+        if (m_entries.size() >= m_capacity)
+        {
+            m_index.erase(m_entries.back().first);
+            m_entries.pop_back();
+        }
+        m_entries.emplace_front(key, V());
+        m_index.emplace(key, m_entries.begin());
+        return m_entries.front().second;
+    }
+
+    size_t size() const { return m_entries.size(); }
+    size_t capacity() const { return m_capacity; }
+
+    void clear()
+    {
+        m_index.clear();
+        m_entries.clear();
+    }
+
+private:
+    typedef std::list<std::pair<K, V>> Entries;
+
+    const size_t m_capacity;
+    // Most recently touched first.
+    Entries m_entries;
+    std::unordered_map<K, typename Entries::iterator> m_index;
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+/// @file
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Counters only grow: rates are their differences between two snapshots.
+
+/*!
+ * \brief The SubscriberMetrics struct describes a subscriber of a server
+ */
+struct SubscriberMetrics
+{
+    /// The id the subscriber gave when subscribing
+    std::string id;
+    /// The address of the subscriber
+    std::string peer;
+    /// Number of messages waiting to be written to the subscriber
+    uint64_t queuedMessages = 0;
+    /// Size of the messages waiting to be written to the subscriber
+    uint64_t queuedBytes = 0;
+    /// Number of messages written so far
+    uint64_t writtenMessages = 0;
+    /// Size of the messages written so far, batch framing included
+    uint64_t writtenBytes = 0;
+    /// Number of messages dropped or coalesced because the subscriber did not keep up
+    uint64_t droppedMessages = 0;
+    /// Mean time from starting a write to its completion, which grows with a slow subscriber
+    double meanWriteLatencyUs = 0;
+    /// Longest time from starting a write to its completion
+    double maxWriteLatencyUs = 0;
+    /// Number of times the subscriber was woken up by a message while waiting for one
+    uint64_t wakeups = 0;
+    /// Mean time from a message waking the subscriber up to the subscriber proceeding
+    double meanWakeupLatencyUs = 0;
+    /// Longest time from a message waking the subscriber up to the subscriber proceeding
+    double maxWakeupLatencyUs = 0;
+    /// Number of fov_ids whose last event sent is tracked, for object deltas
+    uint64_t objectDeltaStreams = 0;
+};
+
+/*!
+ * \brief The ServerMetrics struct describes a server and its subscribers
+ */
+struct ServerMetrics
+{
+    /// Number of messages pushed so far
+    uint64_t pushedMessages = 0;
+    /// Number of messages dropped so far, before or after dispatching them
+    uint64_t droppedMessages = 0;
+    /// Number of pushed messages waiting to be dispatched to the subscribers
+    uint64_t pendingPublications = 0;
+    /// Number of fov_ids whose last objects are kept to work out object deltas
+    uint64_t objectDeltaStreams = 0;
+    /// Time from starting a write to its completion, across the subscribers: number
+    /// and sum of the times so far, and percentiles
+    uint64_t writeLatencyCount = 0;
+    double writeLatencySumUs = 0;
+    double writeLatencyP50Us = 0;
+    double writeLatencyP99Us = 0;
+    /// Time from a message waking an idle subscriber up to the subscriber proceeding
+    uint64_t wakeupLatencyCount = 0;
+    double wakeupLatencySumUs = 0;
+    double wakeupLatencyP50Us = 0;
+    double wakeupLatencyP99Us = 0;
+    /// The subscribers connected
+    std::vector<SubscriberMetrics> subscribers;
+};
+
+/*!
+ * \brief The ClientMetrics struct describes what a client received
+ */
+struct ClientMetrics
+{
+    /// Number of messages passed on to the callback so far
+    uint64_t receivedMessages = 0;
+    /// Size of the replies received so far, batches counted as a whole
+    uint64_t receivedBytes = 0;
+    /// Time taken parsing a received message and converting it to a plain notification, before the callback:
+    /// number and sum of the times so far, and percentiles
+    uint64_t parseTimeCount = 0;
+    double parseTimeSumUs = 0;
+    double parseTimeP50Us = 0;
+    double parseTimeP99Us = 0;
+    /// Number of fov_ids whose last objects are kept to apply object deltas
+    uint64_t objectDeltaStreams = 0;
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "internedstring.h"
+
 #include <string>
 #include <vector>
 #include <memory>
@@ -10,6 +12,11 @@
 
 enum { GRPC_MAX_MESSAGE_SIZE = 16 * 1024 * 1024 };
 
+// Number of fov_ids whose last objects a subscriber asking for object deltas keeps,
+// those it got an event of least recently being forgotten. The server tracks the
+// same ones per subscriber, so that deltas are only sent against objects still kept.
+enum { OBJECT_DELTA_MAX_STREAMS = 1024 };
+
 
 // mappable data
 
@@ -27,8 +34,9 @@ enum { GRPC_MAX_MESSAGE_SIZE = 16 * 1024 * 1024 };
     macro(float, metric) \
     macro(float, centroid_x) \
     macro(float, centroid_y) \
-    macro(std::string, label) \
-    macro(float, score)
+    macro(InternedString, label) \
+    macro(float, score) \
+    macro(uint64_t, id)
 
 #define FOI_IMAGE_X(macro) macro(int32_t, w) macro(int32_t, h)
 
@@ -42,7 +50,7 @@ enum { GRPC_MAX_MESSAGE_SIZE = 16 * 1024 * 1024 };
     macro(float, metric) \
     macro(uint32_t, object_width) \
     macro(uint32_t, object_height) \
-    macro(std::string, category) \
+    macro(InternedString, category) \
     macro(uint64_t, sdu_id) \
     macro(std::string, coordinate) \
     macro(uint32_t, status)
@@ -60,6 +68,87 @@ struct PlainFoiObject
     FOI_OBJECT_X(DECL_MACRO)
 };
 
+/*!
+ * \brief The SharedBuffer class is a read-only view of bytes which keeps their storage alive
+ *
+ * It lets received image bytes be handed over to callbacks and published again without copies.
+ */
+class SharedBuffer
+{
+public:
+    SharedBuffer() = default;
+
+    /*!
+     * \brief Takes ownership of the bytes
+     */
+    SharedBuffer(std::vector<char> data)
+    {
+        auto storage = std::make_shared<const std::vector<char>>(std::move(data));
+        data_ = storage->data();
+        size_ = storage->size();
+        owner_ = std::move(storage);
+    }
+
+    /*!
+     * \brief Refers to bytes stored by owner
+     */
+    SharedBuffer(const char* data, size_t size, std::shared_ptr<const void> owner)
+        : data_(data), size_(size), owner_(std::move(owner))
+    {
+    }
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const char* begin() const { return data_; }
+    const char* end() const { return data_ + size_; }
+
+    char operator[](size_t i) const { return data_[i]; }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    std::shared_ptr<const void> owner_;
+};
+
+/*!
+ * \brief How image bytes are encoded on the wire
+ *
+ * Numbered as the Codec enum of Fov.proto. Received images are always decoded.
+ */
+enum class ImageCodec
+{
+    NONE = 0,   ///< as is
+    DEFLATE = 1 ///< zlib
+};
+
+/*!
+ * \brief Resolution tier of the images sent to a subscriber
+ *
+ * Numbered as the ImageScale enum of Fov.proto.
+ */
+enum class ImageScale
+{
+    FULL = 0,
+    HALF = 1,
+    QUARTER = 2
+};
+
+/*!
+ * \brief JPEG quality tier of the images sent to a subscriber
+ *
+ * Numbered as the ImageQuality enum of Fov.proto. Images are only re-encoded if
+ * either the scale or the quality is not the original one.
+ */
+enum class ImageQuality
+{
+    ORIGINAL = 0,
+    HIGH = 1,
+    MEDIUM = 2,
+    LOW = 3
+};
+
 /*!
  * \brief The PlainFoiImage struct
  */
@@ -67,7 +156,7 @@ struct PlainFoiImage
 {
     FOI_IMAGE_X(DECL_MACRO)
 
-    std::vector<char> data;
+    SharedBuffer data;
 };
 
 /*!
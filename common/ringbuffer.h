@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// Fixed-capacity lock-free queue, safe for any number of producers and consumers.
+// Each cell carries a sequence number telling whether it is ready to be written
+// or read at a given position, so neither side ever takes a lock or allocates.
+// http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+
+template<typename T>
+class RingBuffer
+{
+public:
+    explicit RingBuffer(size_t capacity)
+        : m_capacity(capacity > 0 ? capacity : 1)
+        , m_cells(new Cell[m_capacity])
+    {
+        for (size_t i = 0; i < m_capacity; ++i)
+        {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator=(const RingBuffer&) = delete;
+
+    // Returns false if the buffer is full.
+    bool push(T value)
+    {
+        Cell* cell;
+        size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            cell = &m_cells[pos % m_capacity];
+            const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false if the buffer is empty.
+    bool pop(T& value)
+    {
+        Cell* cell;
+        size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            cell = &m_cells[pos % m_capacity];
+            const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0)
+            {
+                if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->value);
+        cell->value = T();
+        cell->sequence.store(pos + m_capacity, std::memory_order_release);
+        return true;
+    }
+
+    // A push still in progress already counts as content.
+    bool empty() const
+    {
+        return m_enqueuePos.load(std::memory_order_acquire) == m_dequeuePos.load(std::memory_order_acquire);
+    }
+
+    // Approximate while pushes and pops are in progress.
+    size_t size() const
+    {
+        const size_t dequeuePos = m_dequeuePos.load(std::memory_order_acquire);
+        const size_t enqueuePos = m_enqueuePos.load(std::memory_order_acquire);
+        return (enqueuePos > dequeuePos) ? std::min(enqueuePos - dequeuePos, m_capacity) : 0;
+    }
+
+    size_t capacity() const { return m_capacity; }
+
+private:
+    enum { CACHE_LINE_SIZE = 64 };
+
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    const size_t m_capacity;
+    const std::unique_ptr<Cell[]> m_cells;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_enqueuePos{ 0 };
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_dequeuePos{ 0 };
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+/// @file
+
+#include "latencyhistogram.h"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/*!
+ * \brief The stages of a traced message, in order
+ */
+enum class TraceStage
+{
+    PUSHED,     ///< passed to Push
+    SERIALIZED, ///< serialized, once for all the subscribers, and queued for dispatch
+    DEQUEUED,   ///< taken out of the queue of a subscriber and handed over to gRPC
+    WRITTEN,    ///< written, as gRPC completes the write; stamped on the server side only
+    RECEIVED,   ///< read by the client off the wire, before being parsed
+    PARSED,     ///< parsed and converted to a plain notification, with its objects rebuilt
+    DELIVERED,  ///< returned from the callback
+    COUNT
+};
+
+constexpr size_t kNumTraceStages = static_cast<size_t>(TraceStage::COUNT);
+
+/*!
+ * \brief Monotonic time stamp in nanoseconds
+ *
+ * The steady clock is shared by the processes of a host, so that stamps taken by the server
+ * and the client compare on the same host only.
+ */
+inline uint64_t TraceNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*!
+ * \brief The TraceStamps struct holds the time a message reached each stage, 0 if not stamped
+ */
+struct TraceStamps
+{
+    std::array<uint64_t, kNumTraceStages> ns{};
+
+    uint64_t& operator[](TraceStage stage) { return ns[static_cast<size_t>(stage)]; }
+    uint64_t operator[](TraceStage stage) const { return ns[static_cast<size_t>(stage)]; }
+};
+
+/*!
+ * \brief The TraceHistograms class collects the time traced messages spend reaching each stage
+ */
+class TraceHistograms
+{
+public:
+    /*!
+     * \brief Time from the previous stage stamped to stage, in nanoseconds; empty for TraceStage::PUSHED
+     *
+     * The client does not know when the server write completed, so its TraceStage::RECEIVED
+     * times run from TraceStage::DEQUEUED: they are the transport time.
+     */
+    const LatencyHistogram& stage(TraceStage stage) const { return stages_[static_cast<size_t>(stage)]; }
+
+    /*!
+     * \brief Time from TraceStage::PUSHED to the last stage stamped, in nanoseconds
+     */
+    const LatencyHistogram& total() const { return total_; }
+
+    /*!
+     * \brief Records the intervals between each stage stamped and the previous one stamped
+     *
+     * Negative intervals, between stamps of hosts whose clocks differ, are left out.
+     */
+    void record(const TraceStamps& stamps)
+    {
+        size_t previous = 0;
+        for (size_t i = 1; i < kNumTraceStages; ++i)
+        {
+            if (stamps.ns[i] == 0)
+            {
+                continue;
+            }
+            if (stamps.ns[previous] != 0 && stamps.ns[i] >= stamps.ns[previous])
+            {
+                stages_[i].record(stamps.ns[i] - stamps.ns[previous]);
+            }
+            previous = i;
+        }
+        const auto pushed = stamps[TraceStage::PUSHED];
+        for (size_t i = kNumTraceStages; pushed != 0 && i-- > 1;)
+        {
+            if (stamps.ns[i] != 0)
+            {
+                if (stamps.ns[i] >= pushed)
+                {
+                    total_.record(stamps.ns[i] - pushed);
+                }
+                break;
+            }
+        }
+    }
+
+    void reset()
+    {
+        for (auto& v : stages_)
+        {
+            v.reset();
+        }
+        total_.reset();
+    }
+
+private:
+    std::array<LatencyHistogram, kNumTraceStages> stages_;
+    LatencyHistogram total_;
+};
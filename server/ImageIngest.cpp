@@ -0,0 +1,182 @@
+#include "ImageIngest.h"
+
+#include "exif.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <system_error>
+#include <utility>
+
+
+namespace {
+
+uint32_t ReadBigEndian(const unsigned char* p, size_t numBytes)
+{
+    uint32_t result = 0;
+    for (size_t i = 0; i < numBytes; ++i)
+    {
+        result = (result << 8) | p[i];
+    }
+    return result;
+}
+
+bool ParseJpegSize(const unsigned char* p, size_t size, int32_t& width, int32_t& height)
+{
+    int orientation = 1;
+    size_t i = 2;
+    while (i + 4 <= size)
+    {
+        if (p[i] != 0xFF)
+        {
+            return false;
+        }
+        const unsigned char marker = p[i + 1];
+        if (marker == 0xFF)
+        {
+            // Fill byte.
+            ++i;
+            continue;
+        }
+        i += 2;
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+        {
+            // No length.
+            continue;
+        }
+
+        const size_t length = ReadBigEndian(p + i, 2);
+        if (length < 2 || i + length > size)
+        {
+            return false;
+        }
+        if (marker == 0xE1)
+        {
+            orientation = ReadExifOrientation(p + i + 2, length - 2);
+        }
+        // Start of frame, but for DHT, JPG and DAC.
+        else if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+        {
+            if (length < 7)
+            {
+                return false;
+            }
+            height = static_cast<int32_t>(ReadBigEndian(p + i + 3, 2));
+            width = static_cast<int32_t>(ReadBigEndian(p + i + 5, 2));
+            // Transposed or rotated by 90 degrees.
+            if (orientation >= 5 && orientation <= 8)
+            {
+                std::swap(width, height);
+            }
+            return true;
+        }
+        else if (marker == 0xDA || marker == 0xD9)
+        {
+            // The image data start before any frame header.
+            return false;
+        }
+        i += length;
+    }
+    return false;
+}
+
+bool ParsePngSize(const unsigned char* p, size_t size, int32_t& width, int32_t& height)
+{
+    // Signature, then the IHDR chunk: length, type, width and height.
+    static const unsigned char signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    if (size < 24 || !std::equal(std::begin(signature), std::end(signature), p)
+        || std::string(reinterpret_cast<const char*>(p + 12), 4) != "IHDR")
+    {
+        return false;
+    }
+    width = static_cast<int32_t>(ReadBigEndian(p + 16, 4));
+    height = static_cast<int32_t>(ReadBigEndian(p + 20, 4));
+    return true;
+}
+
+
+// The file bytes, read into a buffer of their own: a mapping of the file would fault
+// on the next access if the file were truncated while messages still refer to it.
+SharedBuffer Load(const std::string& path)
+{
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    std::vector<char> data;
+    const auto size = f ? static_cast<std::streamoff>(f.tellg()) : 0;
+    if (size > 0)
+    {
+        data.resize(static_cast<size_t>(size));
+        f.seekg(0);
+        f.read(data.data(), size);
+        // The file may have shrunk meanwhile.
+        data.resize(static_cast<size_t>(f.gcount()));
+    }
+    return data;
+}
+
+std::shared_ptr<const PlainFoiImage> LoadImage(const std::string& path)
+{
+    auto data = Load(path);
+    int32_t width = 0;
+    int32_t height = 0;
+    if (!ParseImageSize(data.data(), data.size(), width, height))
+    {
+        return nullptr;
+    }
+    return std::make_shared<const PlainFoiImage>(PlainFoiImage{ width, height, std::move(data) });
+}
+
+} // namespace
+
+
+bool ParseImageSize(const char* data, size_t size, int32_t& width, int32_t& height)
+{
+    const auto p = reinterpret_cast<const unsigned char*>(data);
+    if (size >= 2 && p[0] == 0xFF && p[1] == 0xD8)
+    {
+        return ParseJpegSize(p, size, width, height);
+    }
+    return ParsePngSize(p, size, width, height);
+}
+
+
+ImageIngest::ImageIngest(std::filesystem::path folder)
+    : folder_(std::move(folder))
+{
+}
+
+const std::vector<ImageIngest::Entry>& ImageIngest::scan()
+{
+    // Listed on every pass: the directory changes when files are added or removed,
+    // not when one is rewritten in place.
+    std::error_code error;
+    std::vector<Entry> entries;
+    std::unordered_map<std::string, Loaded> nextLoaded;
+    for (const auto& p : std::filesystem::directory_iterator(folder_, error))
+    {
+        if (!p.is_regular_file(error))
+        {
+            continue;
+        }
+        const auto path = p.path().string();
+        Loaded current{ p.file_size(error), p.last_write_time(error), nullptr };
+        // Unchanged files are not loaded again.
+        const auto it = loaded_.find(path);
+        if (it != loaded_.end() && it->second.size == current.size && it->second.time == current.time)
+        {
+            current.image = it->second.image;
+        }
+        else
+        {
+            current.image = LoadImage(path);
+        }
+        if (current.image)
+        {
+            entries.push_back({ path, current.image });
+        }
+        nextLoaded.emplace(path, std::move(current));
+    }
+
+    loaded_ = std::move(nextLoaded);
+    entries_ = std::move(entries);
+    return entries_;
+}
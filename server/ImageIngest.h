@@ -0,0 +1,49 @@
+#pragma once
+
+#include "notifications.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Reads the dimensions of a JPEG or PNG image out of its header, without decoding it.
+// Those of JPEG images are swapped if their EXIF orientation rotates them, as cv::imread does.
+bool ParseImageSize(const char* data, size_t size, int32_t& width, int32_t& height);
+
+// Loads the images of a directory once and keeps them across passes: each file is
+// read in one go and only its header is parsed. Every pass lists the directory and
+// looks at the size and modification time of each file, which is loaded again if
+// either changed. The images own their bytes, so that files may be rewritten while
+// messages still refer to their previous contents.
+class ImageIngest
+{
+public:
+    struct Entry
+    {
+        std::string path;
+        std::shared_ptr<const PlainFoiImage> image;
+    };
+
+    explicit ImageIngest(std::filesystem::path folder);
+
+    // The images of the directory, in listing order, leaving out the files that are
+    // not JPEG or PNG images.
+    const std::vector<Entry>& scan();
+
+private:
+    // What was loaded out of each file, null if it is not an image.
+    struct Loaded
+    {
+        uintmax_t size;
+        std::filesystem::file_time_type time;
+        std::shared_ptr<const PlainFoiImage> image;
+    };
+
+    std::filesystem::path folder_;
+    std::vector<Entry> entries_;
+    std::unordered_map<std::string, Loaded> loaded_;
+};
@@ -0,0 +1,92 @@
+#include "Pacer.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+
+namespace {
+
+// sleep_until wakes up tens of microseconds late; the rest is waited for by yielding.
+const auto kSpinMargin = std::chrono::microseconds(200);
+
+const auto kMaxBacklog = std::chrono::seconds(1);
+
+template<typename D>
+Pacer::Clock::duration AsClockDuration(D duration)
+{
+    return std::chrono::duration_cast<Pacer::Clock::duration>(duration);
+}
+
+} // namespace
+
+
+Pacer::Pacer(double rate, size_t burst, std::chrono::duration<double> reportInterval)
+    : rate_(rate)
+    , burst_(std::max<size_t>(burst, 1))
+    , period_((rate > 0) ? AsClockDuration(std::chrono::duration<double>(burst_ / rate)) : Clock::duration::zero())
+    , reportInterval_(AsClockDuration(reportInterval))
+    , start_(Clock::now())
+    , next_(start_)
+    , reported_(start_)
+{
+}
+
+void Pacer::wait()
+{
+    if (inBurst_ == 0 && period_ > Clock::duration::zero())
+    {
+        const auto now = Clock::now();
+        if (now - next_ > kMaxBacklog)
+        {
+            next_ = now;
+            ++numBehind_;
+        }
+        else if (now - next_ >= period_)
+        {
+            ++numBehind_;
+        }
+        else if (now < next_)
+        {
+            std::this_thread::sleep_until(next_ - kSpinMargin);
+            while (Clock::now() < next_)
+            {
+                std::this_thread::yield();
+            }
+        }
+        next_ += period_;
+    }
+    inBurst_ = (inBurst_ + 1) % burst_;
+    ++numEvents_;
+
+    if (reportInterval_ > Clock::duration::zero())
+    {
+        const auto now = Clock::now();
+        if (now - reported_ >= reportInterval_)
+        {
+            report("Replay", numEvents_ - numReported_, now - reported_);
+            reported_ = now;
+            numReported_ = numEvents_;
+        }
+    }
+}
+
+void Pacer::summarize() const
+{
+    report("Replay total", numEvents_, Clock::now() - start_);
+}
+
+void Pacer::report(const char* what, size_t numEvents, Clock::duration elapsed) const
+{
+    const auto seconds = std::chrono::duration<double>(elapsed).count();
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1) << what << ": " << numEvents << " events in " << seconds
+        << " s, " << ((seconds > 0) ? numEvents / seconds : 0.) << " events/s";
+    if (rate_ > 0)
+    {
+        line << ", requested " << rate_ << ", " << numBehind_ << " deadlines missed";
+    }
+    std::cout << line.str() << '\n';
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+// Lets events through at a given rate, burst at a time, and reports the rate achieved.
+// Deadlines are absolute, so that time spent between waits does not add up to drift;
+// a pacer which falls more than a second behind gives up catching up, rather than
+// pushing the backlog at once.
+class Pacer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // A rate of 0 lets events through as fast as they come. A report interval of 0
+    // disables the periodic reports.
+    Pacer(double rate, size_t burst, std::chrono::duration<double> reportInterval);
+
+    // Waits until the next event is due, which is at once within a burst.
+    void wait();
+
+    // Prints the totals since construction.
+    void summarize() const;
+
+private:
+    void report(const char* what, size_t numEvents, Clock::duration elapsed) const;
+
+    const double rate_;
+    const size_t burst_;
+    const Clock::duration period_;
+    const Clock::duration reportInterval_;
+
+    const Clock::time_point start_;
+    Clock::time_point next_;
+    size_t inBurst_ = 0;
+    size_t numBehind_ = 0;
+
+    size_t numEvents_ = 0;
+    Clock::time_point reported_;
+    size_t numReported_ = 0;
+};
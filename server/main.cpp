@@ -1,11 +1,10 @@
 #include "FovServer.h"
-
+#include "ImageIngest.h"
+#include "MetricsExporter.h"
+#include "Pacer.h"
 
 #include <cxxopts.hpp>
 
-#include "opencv2/imgproc/imgproc.hpp"
-#include "opencv2/highgui/highgui.hpp"
-
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/ini_parser.hpp>
 
@@ -25,6 +24,7 @@
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <stdexcept>
 
 
 namespace {
@@ -52,18 +52,13 @@ void setSignalHandler()
 }
 
 
-std::pair<PlainFoiEvent, bool> GetStuff(const std::string& fname)
+PlainFoiEvent GetStuff(const ImageIngest::Entry& entry)
 {
     using namespace std::chrono;
 
-    cv::Mat frame = cv::imread(fname);
-    if (frame.empty()) {
-        return {};
-    }
-
     PlainFoiEvent notification;
 
-    const auto hash = std::hash<std::string>{}(fname);
+    const auto hash = std::hash<std::string>{}(entry.path);
     const auto angle = hash % 91;
     const auto distance = hash % 37;
     const auto coord = std::to_string(angle) + ';' + std::to_string(distance);
@@ -74,24 +69,36 @@ std::pair<PlainFoiEvent, bool> GetStuff(const std::string& fname)
     notification.timestamp = timestamp;
     notification.coordinate = coord; 
 
-    std::ifstream f(fname, std::ios::binary);
-    std::vector<char> v(std::istreambuf_iterator<char>{f}, {});
-
-    auto image = std::make_shared<const PlainFoiImage>(PlainFoiImage{ frame.cols, frame.rows, std::move(v) });
-
-    notification.image = image;
+    // Shared with the ingest cache, not copied.
+    notification.image = entry.image;
 
+    const auto width = entry.image->w;
+    const auto height = entry.image->h;
     notification.objects.push_back({ 
         0,
         0,
-        frame.cols,
-        frame.rows,
+        width,
+        height,
         108,
-        static_cast<float>(frame.cols / 2),
-        static_cast<float>(frame.rows / 2)
+        static_cast<float>(width / 2),
+        static_cast<float>(height / 2)
         });
 
-    return { std::move(notification), true };
+    return notification;
+}
+
+OverflowPolicy AsOverflowPolicy(const std::string& name)
+{
+    if (name == "drop-oldest") {
+        return OverflowPolicy::DROP_OLDEST;
+    }
+    if (name == "drop-newest") {
+        return OverflowPolicy::DROP_NEWEST;
+    }
+    if (name == "coalesce-latest") {
+        return OverflowPolicy::COALESCE_LATEST;
+    }
+    throw std::invalid_argument("Unknown overflow policy: " + name);
 }
 
 const int min_object_size = 100;
@@ -109,7 +116,23 @@ int main(int argc, char* argv[])
         options.add_options()
             ("a,addr", "IP Address", cxxopts::value<std::string>()->default_value("0.0.0.0:50051"))
             ("p,path", "Directory Path", cxxopts::value<std::string>()->default_value({}))
-            ("s,sleep", "Sleep time between generations in seconds", cxxopts::value<int>()->default_value("1"))
+            ("s,sleep", "Sleep time between generations in seconds, possibly fractional", cxxopts::value<double>()->default_value("1"))
+            ("f,fps", "Events published per second, overriding --sleep if not 0", cxxopts::value<double>()->default_value("0"))
+            ("burst", "Number of events published back to back at each deadline", cxxopts::value<size_t>()->default_value("1"))
+            ("l,loops", "Number of passes over the directory, 0 for no end", cxxopts::value<size_t>()->default_value("0"))
+            ("preload", "Load the images into memory before publishing, and do not list the directory again",
+                cxxopts::value<bool>()->default_value("false"))
+            ("report", "Interval between rate reports in seconds, 0 for none", cxxopts::value<double>()->default_value("5"))
+            ("q,queue", "Maximum number of messages queued per subscriber", cxxopts::value<size_t>()->default_value("100"))
+            ("b,queue-bytes", "Maximum number of bytes queued per subscriber", cxxopts::value<size_t>()->default_value("67108864"))
+            ("o,overflow", "Subscriber queue overflow policy: drop-oldest, drop-newest or coalesce-latest",
+                cxxopts::value<std::string>()->default_value("drop-oldest"))
+            ("c,cqs", "Number of server completion queues", cxxopts::value<size_t>()->default_value("1"))
+            ("t,cq-threads", "Number of threads per server completion queue", cxxopts::value<size_t>()->default_value("1"))
+            ("encoding-threads", "Number of threads re-encoding images for the subscribers asking for smaller ones",
+                cxxopts::value<size_t>()->default_value("2"))
+            ("metrics-port", "Local port serving /metrics (Prometheus) and /metrics.json, 0 for none",
+                cxxopts::value<uint16_t>()->default_value("0"))
             ;
 
         auto result = options.parse(argc, argv);
@@ -121,24 +144,61 @@ int main(int argc, char* argv[])
             std::cout << "No directory path provided.\n";
         }
 
-        auto server = MakePublishSubscribeServer(result["addr"].as<std::string>());
+        ServerOptions serverOptions;
+        serverOptions.maxQueuedMessages = result["queue"].as<size_t>();
+        serverOptions.maxQueuedBytes = result["queue-bytes"].as<size_t>();
+        serverOptions.overflowPolicy = AsOverflowPolicy(result["overflow"].as<std::string>());
+        serverOptions.numCompletionQueues = result["cqs"].as<size_t>();
+        serverOptions.numThreadsPerQueue = result["cq-threads"].as<size_t>();
+        serverOptions.numEncodingThreads = result["encoding-threads"].as<size_t>();
+
+        auto server = MakePublishSubscribeServer(result["addr"].as<std::string>(), serverOptions);
+
+        std::unique_ptr<MetricsExporter> metricsExporter;
+        if (const auto metricsPort = result["metrics-port"].as<uint16_t>()) {
+            metricsExporter = std::make_unique<MetricsExporter>(metricsPort, [&server](MetricsFormat format) {
+                return FormatMetrics(server->GetMetrics(), format);
+            });
+        }
 
-        const auto sleepTime = result["sleep"].as<int>();
-				
+        const auto sleepTime = result["sleep"].as<double>();
+        const auto fps = result["fps"].as<double>();
+        const auto loops = result["loops"].as<size_t>();
+        const auto preload = result["preload"].as<bool>();
+
+        ImageIngest ingest(folder);
+        std::vector<ImageIngest::Entry> preloaded;
+        if (preload) {
+            preloaded = ingest.scan();
+            if (preloaded.empty()) {
+                throw std::runtime_error("No images to preload in " + folder);
+            }
+        }
 
-		while(!shutdownRequested)
-		{
-            for (auto& p : std::filesystem::directory_iterator(folder))
+        Pacer pacer((fps > 0) ? fps : (sleepTime > 0) ? 1 / sleepTime : 0,
+            result["burst"].as<size_t>(),
+            std::chrono::duration<double>(result["report"].as<double>()));
+
+        size_t pass = 0;
+        while (!shutdownRequested && (loops == 0 || pass < loops))
+        {
+            const auto& entries = preload ? preloaded : ingest.scan();
+            if (entries.empty()) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                continue;
+            }
+            for (const auto& entry : entries)
             {
-                if (p.is_regular_file())
-                {
-                    if (auto[notification, ok] = GetStuff(p.path().string()); ok) {
-                        server->Push(notification);
-                        std::this_thread::sleep_for(std::chrono::seconds(sleepTime));
-                    }
+                if (shutdownRequested) {
+                    break;
                 }
+                pacer.wait();
+                server->Push(GetStuff(entry));
             }
-		}
+            ++pass;
+        }
+
+        pacer.summarize();
     }
     catch (const std::exception& ex) {
         std::cerr << "Exception " << typeid(ex).name() << ": " << ex.what() << '\n';
@@ -4,32 +4,49 @@
 
 #include "Fov.grpc.pb.h"
 
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
 
 namespace {
 
-#define MOVE_STUFF_MACRO(type, name) result.set_##name(src.name);
-#define MOVE_STUFF_PTR_MACRO(type, name) pResult->set_##name(src.name);
+// Interned strings are sent as ids, see Fov::Label.
+template<typename M, typename T, typename S, typename I>
+void SetField(M& message, const T& value, S setValue, I)
+{
+    setValue(message, value);
+}
 
-auto AsFoiImage(const PlainFoiImage& src)
+template<typename M, typename S, typename I>
+void SetField(M& message, const InternedString& value, S, I setId)
 {
-    auto pResult = std::make_unique<Fov::Image>();
-    FOI_IMAGE_X(MOVE_STUFF_PTR_MACRO)
-    pResult->set_data(src.data.data(), src.data.size());
-    return pResult;
+    setId(message, value.id());
 }
 
+#define MOVE_STUFF_MACRO(type, name) SetField(result, src.name, \
+    [](auto& m, const auto& v) { m.set_##name(v); }, [](auto& m, uint32_t id) { m.set_##name##_id(id); });
+#define MOVE_STUFF_PTR_MACRO(type, name) SetField(*pResult, src.name, \
+    [](auto& m, const auto& v) { m.set_##name(v); }, [](auto& m, uint32_t id) { m.set_##name##_id(id); });
+
  void AsFoiObject(const PlainFoiObject& src, Fov::Object* pResult)
 {
     FOI_OBJECT_X(MOVE_STUFF_PTR_MACRO)
 }
 
+// The images are left out, see SerializedMessageBuilder.
 Fov::Event AsFoi(const PlainFoiEvent& src)
 {
     Fov::Event result;
     FOI_EVENT_X(MOVE_STUFF_MACRO)
 
-    result.set_allocated_image(AsFoiImage(*src.image).release());
-
     for (const auto& v : src.objects)
     {
         AsFoiObject(v, result.add_objects());
@@ -44,27 +61,441 @@ Fov::Notify AsFoi(const PlainFoiNotify& src)
 
     FOI_NOTIFY_X(MOVE_STUFF_MACRO)
 
-    for (const auto& v : src.images)
+    return result;
+}
+
+void AddLabel(std::vector<InternedString>& labels, const InternedString& label)
+{
+    if (!label.empty() && std::none_of(labels.begin(), labels.end(),
+        [&label](const InternedString& v) { return v.id() == label.id(); }))
+    {
+        labels.push_back(label);
+    }
+}
+
+Fov::Image AsFoiImageHeader(const PlainFoiImage& src)
+{
+    Fov::Image result;
+    FOI_IMAGE_X(MOVE_STUFF_MACRO)
+    return result;
+}
+
+
+// Returns false if the data do not shrink.
+bool Deflate(const SharedBuffer& data, std::string& result)
+{
+    auto size = compressBound(static_cast<uLong>(data.size()));
+    result.resize(size);
+    if (compress2(reinterpret_cast<Bytef*>(&result[0]), &size,
+            reinterpret_cast<const Bytef*>(data.data()), static_cast<uLong>(data.size()), Z_DEFAULT_COMPRESSION) != Z_OK
+        || size >= data.size())
     {
-        const auto& src = *v;
-        auto pResult = result.add_images();
-        FOI_IMAGE_X(MOVE_STUFF_PTR_MACRO)
-        pResult->set_data(src.data.data(), src.data.size());
+        result.clear();
+        return false;
+    }
+    result.resize(size);
+    return true;
+}
+
+
+int AsJpegQuality(ImageQuality quality)
+{
+    switch (quality)
+    {
+    case ImageQuality::HIGH: return 90;
+    case ImageQuality::MEDIUM: return 75;
+    case ImageQuality::LOW: return 50;
+    default: return 95;
+    }
+}
+
+// Scales the image down and re-encodes it as JPEG; returns it as is if it cannot be decoded.
+std::shared_ptr<const PlainFoiImage> Reencode(
+    const std::shared_ptr<const PlainFoiImage>& image, ImageScale scale, ImageQuality quality)
+{
+    if (image->data.empty())
+    {
+        return image;
+    }
+    auto frame = cv::imdecode(cv::_InputArray(image->data.data(), static_cast<int>(image->data.size())), cv::IMREAD_COLOR);
+    if (frame.empty())
+    {
+        return image;
+    }
+
+    const int divisor = (scale == ImageScale::QUARTER) ? 4 : (scale == ImageScale::HALF) ? 2 : 1;
+    if (divisor > 1)
+    {
+        cv::resize(frame, frame, { std::max(frame.cols / divisor, 1), std::max(frame.rows / divisor, 1) },
+            0, 0, cv::INTER_AREA);
     }
 
+    std::vector<uchar> buffer;
+    if (!cv::imencode(".jpg", frame, buffer, { cv::IMWRITE_JPEG_QUALITY, AsJpegQuality(quality) }))
+    {
+        return image;
+    }
+
+    auto result = std::make_shared<PlainFoiImage>();
+    result->w = frame.cols;
+    result->h = frame.rows;
+    result->data = std::vector<char>(buffer.begin(), buffer.end());
     return result;
 }
 
 
+// Builds a serialized message out of its protobuf fields followed by image fields,
+// without copying the image bytes: they are referenced by slices which keep the
+// images alive. Protobuf parsers accept fields in any order, so the result is
+// parsed as if the images were set in the message.
+class SerializedMessageBuilder
+{
+public:
+    explicit SerializedMessageBuilder(const std::string& fields)
+        : pending_(fields)
+    {
+    }
+
+    // image is already scaled and re-encoded as asked, see MessageSource::Tier.
+    void AppendImage(int fieldNumber, const std::shared_ptr<const PlainFoiImage>& image, ImageCodec codec)
+    {
+        auto header = AsFoiImageHeader(*image);
+        std::string encoded;
+        if (codec == ImageCodec::DEFLATE && !image->data.empty() && Deflate(image->data, encoded))
+        {
+            header.set_codec(Fov::CODEC_DEFLATE);
+            header.set_raw_size(image->data.size());
+        }
+        const auto serializedHeader = header.SerializeAsString();
+        const auto dataSize = encoded.empty() ? image->data.size() : encoded.size();
+
+        std::string dataPrefix;
+        if (dataSize > 0)
+        {
+            AppendLengthDelimitedTag(dataPrefix, Fov::Image::kDataFieldNumber);
+            AppendVarint(dataPrefix, dataSize);
+        }
+
+        AppendLengthDelimitedTag(pending_, fieldNumber);
+        AppendVarint(pending_, serializedHeader.size() + dataPrefix.size() + dataSize);
+        pending_ += serializedHeader;
+        pending_ += dataPrefix;
+
+        if (dataSize > 0)
+        {
+            Flush();
+            size_ += dataSize;
+            if (!encoded.empty())
+            {
+                auto storage = new std::string(std::move(encoded));
+                slices_.emplace_back(
+                    &(*storage)[0], storage->size(),
+                    [](void* owner) { delete static_cast<std::string*>(owner); },
+                    storage);
+            }
+            else
+            {
+                slices_.emplace_back(
+                    const_cast<char*>(image->data.data()), dataSize,
+                    [](void* owner) { delete static_cast<std::shared_ptr<const PlainFoiImage>*>(owner); },
+                    new std::shared_ptr<const PlainFoiImage>(image));
+            }
+        }
+    }
+
+    grpc::ByteBuffer Finish(size_t* size)
+    {
+        Flush();
+        if (size)
+        {
+            *size = size_;
+        }
+        return grpc::ByteBuffer(slices_.data(), slices_.size());
+    }
+
+private:
+    void Flush()
+    {
+        if (!pending_.empty())
+        {
+            size_ += pending_.size();
+            slices_.emplace_back(pending_);
+            pending_.clear();
+        }
+    }
+
+    std::string pending_;
+    std::vector<grpc::Slice> slices_;
+    size_t size_ = 0;
+};
+
+#define EQUAL_MACRO(type, name) && a.name == b.name
+
+bool IsSameObject(const PlainFoiObject& a, const PlainFoiObject& b)
+{
+    return true FOI_OBJECT_X(EQUAL_MACRO);
+}
+
+#undef EQUAL_MACRO
+
+// Fills delta with how current differs from previous, see Fov::ObjectDelta. Returns
+// false if they cannot be told apart by id, if the kept objects are reordered or
+// if the delta would not be any smaller.
+bool MakeObjectDelta(const std::vector<PlainFoiObject>& previous, const std::vector<PlainFoiObject>& current,
+    Fov::ObjectDelta& delta)
+{
+    std::unordered_map<uint64_t, size_t> currentIndices;
+    for (size_t i = 0; i < current.size(); ++i)
+    {
+        if (current[i].id == 0 || !currentIndices.emplace(current[i].id, i).second)
+        {
+            return false;
+        }
+    }
+
+    std::unordered_set<uint64_t> previousIds;
+    size_t numKept = 0;
+    for (const auto& v : previous)
+    {
+        if (v.id == 0 || !previousIds.insert(v.id).second)
+        {
+            return false;
+        }
+        const auto it = currentIndices.find(v.id);
+        if (it == currentIndices.end())
+        {
+            delta.add_removed_ids(v.id);
+        }
+        else if (it->second != numKept++)
+        {
+            return false;
+        }
+        else if (!IsSameObject(v, current[it->second]))
+        {
+            AsFoiObject(current[it->second], delta.add_upserted());
+        }
+    }
+    // The objects after the kept ones are new.
+    for (size_t i = numKept; i < current.size(); ++i)
+    {
+        AsFoiObject(current[i], delta.add_upserted());
+    }
+
+    return static_cast<size_t>(delta.upserted_size()) < current.size();
+}
+
+// Numbers the events and works out how their objects differ from those of the
+// previous event of their fov_id, sending them in full every keyframeInterval events.
+// Only the objects of the OBJECT_DELTA_MAX_STREAMS fov_ids published last are kept.
+// May be called by concurrent publishers.
+class ObjectDeltaEncoder
+{
+public:
+    explicit ObjectDeltaEncoder(size_t keyframeInterval)
+        : keyframeInterval_(keyframeInterval), streams_(OBJECT_DELTA_MAX_STREAMS) {}
+
+    // Returns the sequence number of event, never reused, even once forgotten. delta is
+    // set if base, the sequence number of the previous event of its fov_id, is not 0.
+    uint64_t Encode(const PlainFoiEvent& event, Fov::ObjectDelta& delta, uint64_t& base)
+    {
+        std::lock_guard<std::mutex> locker(mutex_);
+        bool found;
+        auto& stream = streams_.touch(event.fov_id, found);
+        const bool hasDelta = found && stream.sinceKeyframe + 1 < keyframeInterval_
+            && MakeObjectDelta(stream.objects, event.objects, delta);
+        base = hasDelta ? stream.sequence : 0;
+        stream.sinceKeyframe = hasDelta ? stream.sinceKeyframe + 1 : 0;
+        stream.objects = event.objects;
+        stream.sequence = ++lastSequence_;
+        return stream.sequence;
+    }
+
+    // Forgets the objects, while no subscriber asks for deltas.
+    void Clear()
+    {
+        std::lock_guard<std::mutex> locker(mutex_);
+        streams_.clear();
+    }
+
+    // Number of fov_ids whose objects are kept.
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> locker(mutex_);
+        return streams_.size();
+    }
+
+private:
+    struct Stream
+    {
+        uint64_t sequence = 0;
+        size_t sinceKeyframe = 0;
+        std::vector<PlainFoiObject> objects;
+    };
+
+    const size_t keyframeInterval_;
+    mutable std::mutex mutex_;
+    uint64_t lastSequence_ = 0;
+    LruMap<std::string, Stream> streams_;
+};
+
+
+// What a publication is made of, kept to encode its images or objects on demand.
+struct MessageSource
+{
+    std::string fields;
+    // The fields with the objects replaced by their delta, if any.
+    std::string deltaFields;
+    std::vector<std::pair<int, std::shared_ptr<const PlainFoiImage>>> images;
+
+    grpc::ByteBuffer Encode(const ImageEncoding& encoding, bool delta, size_t* size = nullptr) const
+    {
+        SerializedMessageBuilder builder(delta ? deltaFields : fields);
+        const auto* tier = Tier(encoding);
+        for (size_t i = 0; i < images.size(); ++i)
+        {
+            builder.AppendImage(images[i].first, tier ? (*tier)[i] : images[i].second, encoding.codec);
+        }
+        return builder.Finish(size);
+    }
+
+    // The images scaled and re-encoded as encoding asks, built once per scale and quality
+    // whatever the variants using them; null if they are sent as they are.
+    const std::vector<std::shared_ptr<const PlainFoiImage>>* Tier(const ImageEncoding& encoding) const
+    {
+        if (images.empty() || !encoding.isReencoded())
+        {
+            return nullptr;
+        }
+
+        ImageTier* tier;
+        {
+            std::lock_guard<std::mutex> locker(tiersMutex_);
+            tier = &tiers_[{ encoding.scale, encoding.quality }];
+        }
+        std::call_once(tier->once, [this, tier, &encoding] {
+            for (const auto& v : images)
+            {
+                tier->images.push_back(Reencode(v.second, encoding.scale, encoding.quality));
+            }
+        });
+        return &tier->images;
+    }
+
+private:
+    struct ImageTier
+    {
+        std::once_flag once;
+        std::vector<std::shared_ptr<const PlainFoiImage>> images;
+    };
+    mutable std::mutex tiersMutex_;
+    // Map nodes stay put as tiers are added.
+    mutable std::map<std::pair<ImageScale, ImageQuality>, ImageTier> tiers_;
+};
+
+SerializedMessage MakePublication(std::shared_ptr<const MessageSource> source, const std::string& key, uint64_t sduId,
+    std::vector<InternedString> labels, uint64_t pushedNs, uint64_t sequence = 0, uint64_t deltaBase = 0)
+{
+    auto result = std::make_shared<Publication>();
+    result->pushedNs = pushedNs;
+    result->labels = std::move(labels);
+    result->buffer = source->Encode({}, false, &result->size);
+    result->key = key;
+    result->sduId = sduId;
+    result->sequence = sequence;
+    result->deltaBase = deltaBase;
+    if (!source->images.empty() || deltaBase != 0)
+    {
+        result->encode = [source](const ImageEncoding& encoding, bool delta) { return source->Encode(encoding, delta); };
+    }
+    if (!source->images.empty())
+    {
+        result->prepare = [source](const ImageEncoding& encoding) { source->Tier(encoding); };
+    }
+    result->serializedNs = TraceNow();
+    return result;
+}
+
+// objectDeltas is null while no subscriber asks for deltas.
+SerializedMessage AsSerialized(const PlainFoiEvent& src, ObjectDeltaEncoder* objectDeltas, uint64_t pushedNs)
+{
+    auto source = std::make_shared<MessageSource>();
+    auto event = AsFoi(src);
+    source->fields = event.SerializeAsString();
+
+    Fov::ObjectDelta delta;
+    uint64_t sequence = 0;
+    uint64_t deltaBase = 0;
+    if (objectDeltas)
+    {
+        sequence = objectDeltas->Encode(src, delta, deltaBase);
+    }
+    if (deltaBase != 0)
+    {
+        event.clear_objects();
+        *event.mutable_object_delta() = std::move(delta);
+        source->deltaFields = event.SerializeAsString();
+    }
+
+    if (src.image)
+    {
+        source->images.emplace_back(Fov::Event::kImageFieldNumber, src.image);
+    }
+    std::vector<InternedString> labels;
+    for (const auto& v : src.objects)
+    {
+        AddLabel(labels, v.label);
+    }
+    return MakePublication(std::move(source), src.fov_id, src.sdu_id, std::move(labels), pushedNs, sequence, deltaBase);
+}
+
+SerializedMessage AsSerialized(const PlainFoiNotify& src, uint64_t pushedNs)
+{
+    auto source = std::make_shared<MessageSource>();
+    source->fields = AsFoi(src).SerializeAsString();
+    for (const auto& v : src.images)
+    {
+        source->images.emplace_back(Fov::Notify::kImagesFieldNumber, v);
+    }
+    std::vector<InternedString> labels;
+    AddLabel(labels, src.category);
+    return MakePublication(std::move(source), src.fov_id, src.sdu_id, std::move(labels), pushedNs);
+}
+
+
 #undef MOVE_STUFF_PTR_MACRO
 #undef MOVE_STUFF_MACRO
 
 
 
+static_assert(static_cast<int>(Fov::EventBatch::kEventsFieldNumber) == static_cast<int>(kBatchFieldNumber)
+    && static_cast<int>(Fov::NotifyBatch::kNotificationsFieldNumber) == static_cast<int>(kBatchFieldNumber), "See MakeBatch");
+
+static_assert(static_cast<int>(Fov::Event::kLabelsFieldNumber) == static_cast<int>(kLabelsFieldNumber)
+    && static_cast<int>(Fov::Notify::kLabelsFieldNumber) == static_cast<int>(kLabelsFieldNumber)
+    && static_cast<int>(Fov::Label::kIdFieldNumber) == static_cast<int>(kLabelIdFieldNumber)
+    && static_cast<int>(Fov::Label::kTextFieldNumber) == static_cast<int>(kLabelTextFieldNumber), "See AppendLabel");
+
+static_assert(static_cast<int>(Fov::Event::kTraceFieldNumber) == static_cast<int>(kTraceFieldNumber)
+    && static_cast<int>(Fov::Notify::kTraceFieldNumber) == static_cast<int>(kTraceFieldNumber)
+    && static_cast<int>(Fov::Trace::kPushedNsFieldNumber) == static_cast<int>(kTracePushedFieldNumber)
+    && static_cast<int>(Fov::Trace::kSerializedNsFieldNumber) == static_cast<int>(kTraceSerializedFieldNumber)
+    && static_cast<int>(Fov::Trace::kDequeuedNsFieldNumber) == static_cast<int>(kTraceDequeuedFieldNumber), "See AppendTrace");
+
+// The responses are written pre-serialized, hence the raw methods.
+typedef Fov::EventSubscriber::WithRawMethod_Subscribe<
+    Fov::EventSubscriber::WithRawMethod_SubscribeBatch<
+    Fov::EventSubscriber::WithRawMethod_SubscribeWithCredit<
+    Fov::EventSubscriber::WithRawMethod_SubscribeBatchWithCredit<Fov::EventSubscriber::Service>>>> EventSubscriberService;
+
+typedef Fov::NotifySubscriber::WithRawMethod_Subscribe<
+    Fov::NotifySubscriber::WithRawMethod_SubscribeBatch<
+    Fov::NotifySubscriber::WithRawMethod_SubscribeWithCredit<
+    Fov::NotifySubscriber::WithRawMethod_SubscribeBatchWithCredit<Fov::NotifySubscriber::Service>>>> NotifySubscriberService;
+
 // class SubscriberCallData
-typedef CallDataTemplate<Fov::Event, Fov::EventChannel, PlainFoiEvent, Fov::EventSubscriber::AsyncService> EventSubscriberCallData;
+typedef CallDataTemplate<Fov::EventChannel, EventSubscriberService> EventSubscriberCallData;
 
-typedef CallDataTemplate<Fov::Notify, Fov::NotifyChannel, PlainFoiNotify, Fov::NotifySubscriber::AsyncService> NotifySubscriberCallData;
+typedef CallDataTemplate<Fov::NotifyChannel, NotifySubscriberService> NotifySubscriberCallData;
 
 //////////////////////////////////////////////////////////////////////////////
 
@@ -73,15 +504,59 @@ class PublishSubscribeServer : public IPublishSubscribeServer, public ServerImpl
 public:
     using ServerImpl::ServerImpl;
 
+    ~PublishSubscribeServer() override {
+        Stop();
+    }
+
 
-    void initCallData() override
+    void initCallData(grpc::ServerCompletionQueue* cq) override
     {
-        new EventSubscriberCallData(observer_, this, subscriberService_);
+        new EventSubscriberCallData(subscribers_, this, subscriberService_, cq, false);
+        new EventSubscriberCallData(subscribers_, this, subscriberService_, cq, true);
+        new EventSubscriberCallData(subscribers_, this, subscriberService_, cq, false, true);
+        new EventSubscriberCallData(subscribers_, this, subscriberService_, cq, true, true);
     }
 
     void Push(const PlainFoiEvent& notification) override
     {
-        observer_(notification);
+        dispatcher_.push(AsSerialized(notification, objectDeltaEncoder(), TraceNow()));
+    }
+
+    void PushBatch(const PlainFoiEvent* notifications, size_t count) override
+    {
+        const auto pushedNs = TraceNow();
+        const auto objectDeltas = objectDeltaEncoder();
+        std::vector<SerializedMessage> messages;
+        messages.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            messages.push_back(AsSerialized(notifications[i], objectDeltas, pushedNs));
+        }
+        dispatcher_.push(messages.data(), messages.size());
+    }
+
+    uint64_t GetDroppedCount() const override
+    {
+        return droppedMessages_;
+    }
+
+    const TraceHistograms* GetTraceHistograms() const override
+    {
+        return traceHistograms_.get();
+    }
+
+    ServerMetrics GetMetrics() const override
+    {
+        auto result = getMetrics();
+        result.pendingPublications = dispatcher_.size();
+        result.objectDeltaStreams = objectDeltas_.size();
+        EventSubscriberCallData::CollectMetrics(subscribers_, result);
+        return result;
+    }
+
+    void wakeSubscribers() override
+    {
+        EventSubscriberCallData::WakeAll(subscribers_);
     }
 
     void RegisterService(grpc::ServerBuilder& builder) override {
@@ -89,23 +564,81 @@ public:
     }
 
 private:
-    Fov::EventSubscriber::AsyncService subscriberService_;
-    boost::signals2::signal<void(const PlainFoiEvent&)> observer_;
+    // The objects are only kept while some subscriber asks for deltas.
+    ObjectDeltaEncoder* objectDeltaEncoder()
+    {
+        if (numDeltaSubscribers_ > 0)
+        {
+            return &objectDeltas_;
+        }
+        objectDeltas_.Clear();
+        return nullptr;
+    }
+
+    EventSubscriberService subscriberService_;
+    SubscriberRegistry<EventSubscriberCallData> subscribers_;
+    ObjectDeltaEncoder objectDeltas_{ options_.objectKeyframeInterval };
+    // Declared last, so that its thread is stopped first.
+    Dispatcher dispatcher_{ this, [this](const SerializedMessage* messages, size_t count) {
+        EventSubscriberCallData::Dispatch(subscribers_, encoders_, messages, count);
+    } };
 };
 
 class NotifyServer : public INotifyServer, public ServerImpl {
 public:
     using ServerImpl::ServerImpl;
 
+    ~NotifyServer() override {
+        Stop();
+    }
+
 
-    void initCallData() override
+    void initCallData(grpc::ServerCompletionQueue* cq) override
     {
-        new NotifySubscriberCallData(observer_, this, subscriberService_);
+        new NotifySubscriberCallData(subscribers_, this, subscriberService_, cq, false);
+        new NotifySubscriberCallData(subscribers_, this, subscriberService_, cq, true);
+        new NotifySubscriberCallData(subscribers_, this, subscriberService_, cq, false, true);
+        new NotifySubscriberCallData(subscribers_, this, subscriberService_, cq, true, true);
     }
 
     void Push(const PlainFoiNotify& notification) override
     {
-        observer_(notification);
+        dispatcher_.push(AsSerialized(notification, TraceNow()));
+    }
+
+    void PushBatch(const PlainFoiNotify* notifications, size_t count) override
+    {
+        const auto pushedNs = TraceNow();
+        std::vector<SerializedMessage> messages;
+        messages.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            messages.push_back(AsSerialized(notifications[i], pushedNs));
+        }
+        dispatcher_.push(messages.data(), messages.size());
+    }
+
+    uint64_t GetDroppedCount() const override
+    {
+        return droppedMessages_;
+    }
+
+    const TraceHistograms* GetTraceHistograms() const override
+    {
+        return traceHistograms_.get();
+    }
+
+    ServerMetrics GetMetrics() const override
+    {
+        auto result = getMetrics();
+        result.pendingPublications = dispatcher_.size();
+        NotifySubscriberCallData::CollectMetrics(subscribers_, result);
+        return result;
+    }
+
+    void wakeSubscribers() override
+    {
+        NotifySubscriberCallData::WakeAll(subscribers_);
     }
 
     void RegisterService(grpc::ServerBuilder& builder) override {
@@ -113,8 +646,12 @@ public:
     }
 
 private:
-    Fov::NotifySubscriber::AsyncService subscriberService_;
-    boost::signals2::signal<void(const PlainFoiNotify&)> observer_;
+    NotifySubscriberService subscriberService_;
+    SubscriberRegistry<NotifySubscriberCallData> subscribers_;
+    // Declared last, so that its thread is stopped first.
+    Dispatcher dispatcher_{ this, [this](const SerializedMessage* messages, size_t count) {
+        NotifySubscriberCallData::Dispatch(subscribers_, encoders_, messages, count);
+    } };
 };
 
 
@@ -122,16 +659,18 @@ private:
 } // namespace
 
 
-std::unique_ptr<IPublishSubscribeServer> MakePublishSubscribeServer(const std::string& serverIpAddress)
+std::unique_ptr<IPublishSubscribeServer> MakePublishSubscribeServer(
+    const std::string& serverIpAddress, const ServerOptions& options)
 {
-    auto result = std::make_unique<PublishSubscribeServer>(serverIpAddress);
+    auto result = std::make_unique<PublishSubscribeServer>(serverIpAddress, options);
     result->RunAsync();
     return result;
 }
 
-std::unique_ptr<INotifyServer> MakeNotifyServer(const std::string& serverIpAddress)
+std::unique_ptr<INotifyServer> MakeNotifyServer(
+    const std::string& serverIpAddress, const ServerOptions& options)
 {
-    auto result = std::make_unique<NotifyServer>(serverIpAddress);
+    auto result = std::make_unique<NotifyServer>(serverIpAddress, options);
     result->RunAsync();
     return result;
 }
@@ -2,10 +2,14 @@
 
 /// @file
 
+#include "metrics.h"
 #include "notifications.hpp"
+#include "ServerOptions.h"
+#include "tracing.h"
 
 #include <memory>
 #include <string>
+#include <vector>
 
 /*!
  * \brief The IPublishSubscribeServer interface
@@ -14,9 +18,38 @@ struct IPublishSubscribeServer
 {
     /*!
      * \brief Push a PlainFoiEvent instance
+     *
+     * The instance is serialized right away; the subscribers are served by another thread.
      * \param notification a PlainFoiEvent instance
      */
     virtual void Push(const PlainFoiEvent& notification) = 0;
+    /*!
+     * \brief Push several PlainFoiEvent instances at once
+     * \param notifications an array of PlainFoiEvent instances
+     * \param count the number of instances
+     */
+    virtual void PushBatch(const PlainFoiEvent* notifications, size_t count) = 0;
+    void PushBatch(const std::vector<PlainFoiEvent>& notifications)
+    {
+        PushBatch(notifications.data(), notifications.size());
+    }
+    /*!
+     * \brief GetDroppedCount
+     * \return the number of messages dropped so far because of full queues
+     */
+    virtual uint64_t GetDroppedCount() const = 0;
+    /*!
+     * \brief GetTraceHistograms
+     * \return the time messages take from Push to being serialized and written to each subscriber,
+     * or nullptr unless ServerOptions::trace
+     */
+    virtual const TraceHistograms* GetTraceHistograms() const = 0;
+    /*!
+     * \brief GetMetrics
+     * \return a snapshot of the counters of the server and of each subscriber connected;
+     * may be called from any thread
+     */
+    virtual ServerMetrics GetMetrics() const = 0;
     virtual ~IPublishSubscribeServer() = default;
 };
 
@@ -27,9 +60,38 @@ struct INotifyServer
 {
     /*!
      * \brief Push a PlainFoiNotify instance
+     *
+     * The instance is serialized right away; the subscribers are served by another thread.
      * \param notification a PlainFoiNotify instance
      */
     virtual void Push(const PlainFoiNotify& notification) = 0;
+    /*!
+     * \brief Push several PlainFoiNotify instances at once
+     * \param notifications an array of PlainFoiNotify instances
+     * \param count the number of instances
+     */
+    virtual void PushBatch(const PlainFoiNotify* notifications, size_t count) = 0;
+    void PushBatch(const std::vector<PlainFoiNotify>& notifications)
+    {
+        PushBatch(notifications.data(), notifications.size());
+    }
+    /*!
+     * \brief GetDroppedCount
+     * \return the number of messages dropped so far because of full queues
+     */
+    virtual uint64_t GetDroppedCount() const = 0;
+    /*!
+     * \brief GetTraceHistograms
+     * \return the time messages take from Push to being serialized and written to each subscriber,
+     * or nullptr unless ServerOptions::trace
+     */
+    virtual const TraceHistograms* GetTraceHistograms() const = 0;
+    /*!
+     * \brief GetMetrics
+     * \return a snapshot of the counters of the server and of each subscriber connected;
+     * may be called from any thread
+     */
+    virtual ServerMetrics GetMetrics() const = 0;
     virtual ~INotifyServer() = default;
 };
 
@@ -40,9 +102,11 @@ struct INotifyServer
  * please use IPv6 any, i.e., [::]:<port>, which also accepts IPv4
  * connections.  Valid values include dns:///localhost:1234, /
  * 192.168.1.1:31416, dns:///[::1]:27182, etc.).
+ * \param options a ServerOptions instance
  * \return
  */
-std::unique_ptr<IPublishSubscribeServer> MakePublishSubscribeServer(const std::string& serverIpAddress);
+std::unique_ptr<IPublishSubscribeServer> MakePublishSubscribeServer(
+    const std::string& serverIpAddress, const ServerOptions& options = {});
 
 /*!
  * \brief MakeNotifyServer make a server broadcasting PlainFoiNotify notigications
@@ -51,6 +115,8 @@ std::unique_ptr<IPublishSubscribeServer> MakePublishSubscribeServer(const std::s
  * please use IPv6 any, i.e., [::]:<port>, which also accepts IPv4
  * connections.  Valid values include dns:///localhost:1234, /
  * 192.168.1.1:31416, dns:///[::1]:27182, etc.).
+ * \param options a ServerOptions instance
  * \return
  */
-std::unique_ptr<INotifyServer> MakeNotifyServer(const std::string& serverIpAddress);
+std::unique_ptr<INotifyServer> MakeNotifyServer(
+    const std::string& serverIpAddress, const ServerOptions& options = {});
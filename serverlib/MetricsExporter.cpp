@@ -0,0 +1,466 @@
+#include "MetricsExporter.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+
+namespace {
+
+#ifdef _WIN32
+using Socket = SOCKET;
+const Socket kInvalidSocket = INVALID_SOCKET;
+void CloseSocket(Socket s) { closesocket(s); }
+#else
+using Socket = int;
+const Socket kInvalidSocket = -1;
+void CloseSocket(Socket s) { close(s); }
+#endif
+
+// A scraper going away mid-response must fail the send, not raise SIGPIPE;
+// macOS has no such flag and uses SO_NOSIGPIPE instead, see Serve.
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+// How often the serving thread checks whether to stop.
+const long kPollIntervalUs = 200 * 1000;
+// Requests are small; anything longer is cut.
+const size_t kMaxRequestSize = 4096;
+
+
+std::string Number(uint64_t value)
+{
+    return std::to_string(value);
+}
+
+std::string Number(double value)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.3f", value);
+    return buffer;
+}
+
+// Escapes a label value, see https://prometheus.io/docs/instrumenting/exposition_formats/
+std::string EscapeLabel(const std::string& value)
+{
+    std::string result;
+    for (char c : value)
+    {
+        switch (c)
+        {
+        case '\\': result += "\\\\"; break;
+        case '"': result += "\\\""; break;
+        case '\n': result += "\\n"; break;
+        default: result += c;
+        }
+    }
+    return result;
+}
+
+std::string EscapeJson(const std::string& value)
+{
+    std::string result;
+    for (unsigned char c : value)
+    {
+        switch (c)
+        {
+        case '\\': result += "\\\\"; break;
+        case '"': result += "\\\""; break;
+        case '\n': result += "\\n"; break;
+        case '\r': result += "\\r"; break;
+        case '\t': result += "\\t"; break;
+        default:
+            if (c < 0x20)
+            {
+                char buffer[8];
+                snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                result += buffer;
+            }
+            else
+            {
+                result += static_cast<char>(c);
+            }
+        }
+    }
+    return result;
+}
+
+class PrometheusWriter
+{
+public:
+    // Starts a metric family; its samples follow.
+    void family(const char* name, const char* type, const char* help)
+    {
+        out_ += std::string("# HELP ") + name + ' ' + help + "\n# TYPE " + name + ' ' + type + '\n';
+    }
+
+    template<typename T>
+    void sample(const std::string& name, const std::string& labels, T value)
+    {
+        out_ += name;
+        if (!labels.empty())
+        {
+            out_ += '{' + labels + '}';
+        }
+        out_ += ' ' + Number(value) + '\n';
+    }
+
+    // A summary of durations, with the quantiles the metrics have.
+    void summary(const char* name, const char* help, double p50, double p99, double sum, uint64_t count)
+    {
+        family(name, "summary", help);
+        sample(name, "quantile=\"0.5\"", p50);
+        sample(name, "quantile=\"0.99\"", p99);
+        sample(std::string(name) + "_sum", {}, sum);
+        sample(std::string(name) + "_count", {}, count);
+    }
+
+    template<typename T>
+    void single(const char* name, const char* type, const char* help, T value)
+    {
+        family(name, type, help);
+        sample(name, {}, value);
+    }
+
+    std::string& str() { return out_; }
+
+private:
+    std::string out_;
+};
+
+class JsonWriter
+{
+public:
+    void begin() { out_ += '{'; first_ = true; }
+    void end() { out_ += '}'; first_ = false; }
+
+    template<typename T>
+    void field(const char* name, T value)
+    {
+        key(name);
+        out_ += Number(value);
+    }
+
+    void field(const char* name, const std::string& value)
+    {
+        key(name);
+        out_ += '"' + EscapeJson(value) + '"';
+    }
+
+    void beginArray(const char* name) { key(name); out_ += '['; first_ = true; }
+    void endArray() { out_ += ']'; first_ = false; }
+
+    void element() { if (!first_) out_ += ','; first_ = false; }
+
+    std::string& str() { return out_; }
+
+private:
+    void key(const char* name)
+    {
+        element();
+        out_ += '"' + std::string(name) + "\":";
+    }
+
+    std::string out_;
+    bool first_ = true;
+};
+
+std::string FormatPrometheus(const ServerMetrics& metrics)
+{
+    PrometheusWriter out;
+    out.single("fov_server_pushed_messages_total", "counter", "Messages pushed.", metrics.pushedMessages);
+    out.single("fov_server_dropped_messages_total", "counter",
+        "Messages dropped because of full queues.", metrics.droppedMessages);
+    out.single("fov_server_pending_publications", "gauge",
+        "Pushed messages waiting to be dispatched.", metrics.pendingPublications);
+    out.single("fov_server_subscribers", "gauge", "Subscribers connected.",
+        static_cast<uint64_t>(metrics.subscribers.size()));
+    out.single("fov_server_object_delta_streams", "gauge",
+        "Event streams, one per fov_id, whose last objects are kept to work out object deltas.", metrics.objectDeltaStreams);
+    out.summary("fov_server_write_latency_microseconds",
+        "Time from starting a write to a subscriber to its completion.",
+        metrics.writeLatencyP50Us, metrics.writeLatencyP99Us, metrics.writeLatencySumUs, metrics.writeLatencyCount);
+    out.summary("fov_server_wakeup_latency_microseconds",
+        "Time from a message waking an idle subscriber up to the subscriber proceeding.",
+        metrics.wakeupLatencyP50Us, metrics.wakeupLatencyP99Us, metrics.wakeupLatencySumUs, metrics.wakeupLatencyCount);
+
+    std::vector<std::string> labels;
+    for (const auto& v : metrics.subscribers)
+    {
+        labels.push_back("id=\"" + EscapeLabel(v.id) + "\",peer=\"" + EscapeLabel(v.peer) + '"');
+    }
+
+    // Grouped by family, as the format requires.
+    const auto subscriberFamily = [&](const char* name, const char* type, const char* help, auto member) {
+        out.family(name, type, help);
+        for (size_t i = 0; i < metrics.subscribers.size(); ++i)
+        {
+            out.sample(name, labels[i], metrics.subscribers[i].*member);
+        }
+    };
+    subscriberFamily("fov_subscriber_queued_messages", "gauge",
+        "Messages waiting to be written.", &SubscriberMetrics::queuedMessages);
+    subscriberFamily("fov_subscriber_queued_bytes", "gauge",
+        "Size of the messages waiting to be written.", &SubscriberMetrics::queuedBytes);
+    subscriberFamily("fov_subscriber_written_messages_total", "counter",
+        "Messages written.", &SubscriberMetrics::writtenMessages);
+    subscriberFamily("fov_subscriber_written_bytes_total", "counter",
+        "Size of the messages written.", &SubscriberMetrics::writtenBytes);
+    subscriberFamily("fov_subscriber_dropped_messages_total", "counter",
+        "Messages dropped or coalesced.", &SubscriberMetrics::droppedMessages);
+    subscriberFamily("fov_subscriber_write_latency_mean_microseconds", "gauge",
+        "Mean time from starting a write to its completion.", &SubscriberMetrics::meanWriteLatencyUs);
+    subscriberFamily("fov_subscriber_write_latency_max_microseconds", "gauge",
+        "Longest time from starting a write to its completion.", &SubscriberMetrics::maxWriteLatencyUs);
+    subscriberFamily("fov_subscriber_wakeups_total", "counter",
+        "Times the subscriber was woken up by a message.", &SubscriberMetrics::wakeups);
+    subscriberFamily("fov_subscriber_wakeup_latency_mean_microseconds", "gauge",
+        "Mean time from a message waking the subscriber up to the subscriber proceeding.",
+        &SubscriberMetrics::meanWakeupLatencyUs);
+    subscriberFamily("fov_subscriber_wakeup_latency_max_microseconds", "gauge",
+        "Longest time from a message waking the subscriber up to the subscriber proceeding.",
+        &SubscriberMetrics::maxWakeupLatencyUs);
+    subscriberFamily("fov_subscriber_object_delta_streams", "gauge",
+        "Event streams, one per fov_id, whose last event sent is tracked for object deltas.", &SubscriberMetrics::objectDeltaStreams);
+
+    return std::move(out.str());
+}
+
+std::string FormatJson(const ServerMetrics& metrics)
+{
+    JsonWriter out;
+    out.begin();
+    out.field("pushedMessages", metrics.pushedMessages);
+    out.field("droppedMessages", metrics.droppedMessages);
+    out.field("pendingPublications", metrics.pendingPublications);
+    out.field("objectDeltaStreams", metrics.objectDeltaStreams);
+    out.field("writeLatencyCount", metrics.writeLatencyCount);
+    out.field("writeLatencySumUs", metrics.writeLatencySumUs);
+    out.field("writeLatencyP50Us", metrics.writeLatencyP50Us);
+    out.field("writeLatencyP99Us", metrics.writeLatencyP99Us);
+    out.field("wakeupLatencyCount", metrics.wakeupLatencyCount);
+    out.field("wakeupLatencySumUs", metrics.wakeupLatencySumUs);
+    out.field("wakeupLatencyP50Us", metrics.wakeupLatencyP50Us);
+    out.field("wakeupLatencyP99Us", metrics.wakeupLatencyP99Us);
+    out.beginArray("subscribers");
+    for (const auto& v : metrics.subscribers)
+    {
+        out.element();
+        out.begin();
+        out.field("id", v.id);
+        out.field("peer", v.peer);
+        out.field("queuedMessages", v.queuedMessages);
+        out.field("queuedBytes", v.queuedBytes);
+        out.field("writtenMessages", v.writtenMessages);
+        out.field("writtenBytes", v.writtenBytes);
+        out.field("droppedMessages", v.droppedMessages);
+        out.field("meanWriteLatencyUs", v.meanWriteLatencyUs);
+        out.field("maxWriteLatencyUs", v.maxWriteLatencyUs);
+        out.field("wakeups", v.wakeups);
+        out.field("meanWakeupLatencyUs", v.meanWakeupLatencyUs);
+        out.field("maxWakeupLatencyUs", v.maxWakeupLatencyUs);
+        out.field("objectDeltaStreams", v.objectDeltaStreams);
+        out.end();
+    }
+    out.endArray();
+    out.end();
+    return std::move(out.str());
+}
+
+std::string FormatPrometheus(const ClientMetrics& metrics)
+{
+    PrometheusWriter out;
+    out.single("fov_client_received_messages_total", "counter",
+        "Messages passed on to the callback.", metrics.receivedMessages);
+    out.single("fov_client_received_bytes_total", "counter", "Size of the replies received.", metrics.receivedBytes);
+    out.summary("fov_client_parse_time_microseconds",
+        "Time converting a received message to a plain notification.",
+        metrics.parseTimeP50Us, metrics.parseTimeP99Us, metrics.parseTimeSumUs, metrics.parseTimeCount);
+    out.single("fov_client_object_delta_streams", "gauge",
+        "Event streams, one per fov_id, whose last objects are kept to apply object deltas.", metrics.objectDeltaStreams);
+    return std::move(out.str());
+}
+
+std::string FormatJson(const ClientMetrics& metrics)
+{
+    JsonWriter out;
+    out.begin();
+    out.field("receivedMessages", metrics.receivedMessages);
+    out.field("receivedBytes", metrics.receivedBytes);
+    out.field("parseTimeCount", metrics.parseTimeCount);
+    out.field("parseTimeSumUs", metrics.parseTimeSumUs);
+    out.field("parseTimeP50Us", metrics.parseTimeP50Us);
+    out.field("parseTimeP99Us", metrics.parseTimeP99Us);
+    out.field("objectDeltaStreams", metrics.objectDeltaStreams);
+    out.end();
+    return std::move(out.str());
+}
+
+void SendAll(Socket s, const std::string& data)
+{
+    for (size_t sent = 0; sent < data.size();)
+    {
+        const auto n = send(s, data.data() + sent, static_cast<int>(data.size() - sent), kSendFlags);
+        if (n <= 0)
+        {
+            return;
+        }
+        sent += n;
+    }
+}
+
+std::string Response(const char* status, const char* contentType, const std::string& body)
+{
+    return std::string("HTTP/1.1 ") + status + "\r\nContent-Type: " + contentType
+        + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+}
+
+} // namespace
+
+
+std::string FormatMetrics(const ServerMetrics& metrics, MetricsFormat format)
+{
+    return (format == MetricsFormat::JSON) ? FormatJson(metrics) : FormatPrometheus(metrics);
+}
+
+std::string FormatMetrics(const ClientMetrics& metrics, MetricsFormat format)
+{
+    return (format == MetricsFormat::JSON) ? FormatJson(metrics) : FormatPrometheus(metrics);
+}
+
+
+MetricsExporter::MetricsExporter(uint16_t port, Source source)
+    : source_(std::move(source))
+{
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+        throw std::runtime_error("Could not initialize Winsock");
+    }
+#endif
+    const Socket listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == kInvalidSocket)
+    {
+        throw std::runtime_error("Could not create the metrics socket");
+    }
+    const int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+        || listen(listener, 8) != 0)
+    {
+        CloseSocket(listener);
+        throw std::runtime_error("Could not listen to metrics port " + std::to_string(port));
+    }
+    listener_ = static_cast<intptr_t>(listener);
+
+    thread_ = std::thread(&MetricsExporter::Run, this);
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    stopRequested_ = true;
+    thread_.join();
+    CloseSocket(static_cast<Socket>(listener_));
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+void MetricsExporter::Run()
+{
+    const auto listener = static_cast<Socket>(listener_);
+    while (!stopRequested_)
+    {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(listener, &readable);
+        timeval timeout{ 0, kPollIntervalUs };
+        if (select(static_cast<int>(listener + 1), &readable, nullptr, nullptr, &timeout) <= 0)
+        {
+            continue;
+        }
+        const Socket connection = accept(listener, nullptr, nullptr);
+        if (connection != kInvalidSocket)
+        {
+            Serve(static_cast<intptr_t>(connection));
+            CloseSocket(connection);
+        }
+    }
+}
+
+void MetricsExporter::Serve(intptr_t connection)
+{
+    const auto s = static_cast<Socket>(connection);
+
+    // A stalled scraper must not hold the thread for long.
+#ifdef _WIN32
+    const DWORD timeout = 1000;
+#else
+    const timeval timeout{ 1, 0 };
+#endif
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+    const int noSigPipe = 1;
+    setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < kMaxRequestSize)
+    {
+        const auto n = recv(s, buffer, sizeof(buffer), 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        request.append(buffer, n);
+    }
+
+    // Request line: method, target, version.
+    const auto lineEnd = request.find("\r\n");
+    const auto line = request.substr(0, lineEnd);
+    const auto targetStart = line.find(' ');
+    const auto targetEnd = line.find(' ', targetStart + 1);
+    if (targetStart == std::string::npos || targetEnd == std::string::npos || line.compare(0, targetStart, "GET") != 0)
+    {
+        SendAll(s, Response("405 Method Not Allowed", "text/plain", "Only GET is supported\n"));
+        return;
+    }
+    auto target = line.substr(targetStart + 1, targetEnd - targetStart - 1);
+    target = target.substr(0, target.find('?'));
+
+    if (target == "/metrics")
+    {
+        SendAll(s, Response("200 OK", "text/plain; version=0.0.4; charset=utf-8", source_(MetricsFormat::PROMETHEUS)));
+    }
+    else if (target == "/metrics.json")
+    {
+        SendAll(s, Response("200 OK", "application/json", source_(MetricsFormat::JSON)));
+    }
+    else
+    {
+        SendAll(s, Response("404 Not Found", "text/plain", "Try /metrics or /metrics.json\n"));
+    }
+}
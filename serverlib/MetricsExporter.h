@@ -0,0 +1,70 @@
+#pragma once
+
+/// @file
+
+#include "metrics.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+/*!
+ * \brief The formats metrics are exported in
+ */
+enum class MetricsFormat
+{
+    PROMETHEUS, ///< Prometheus text exposition format, version 0.0.4
+    JSON        ///< one JSON object, named as the fields of the metrics structs
+};
+
+/*!
+ * \brief FormatMetrics
+ * \param metrics a ServerMetrics instance, as returned by IPublishSubscribeServer::GetMetrics
+ * \param format the format to use
+ * \return the metrics of the server, then of each subscriber, labelled by id and peer
+ */
+std::string FormatMetrics(const ServerMetrics& metrics, MetricsFormat format);
+
+/*!
+ * \brief FormatMetrics
+ * \param metrics a ClientMetrics instance, as returned by IPublishSubscribeClient::GetMetrics
+ * \param format the format to use
+ * \return the metrics of the client
+ */
+std::string FormatMetrics(const ClientMetrics& metrics, MetricsFormat format);
+
+/*!
+ * \brief The MetricsExporter class serves metrics over HTTP on the loopback interface
+ *
+ * GET /metrics answers in the Prometheus format and GET /metrics.json in JSON, each
+ * calling the source on a thread of the exporter; anything else is answered 404.
+ * Requests are served one at a time, which is plenty for a scraper.
+ */
+class MetricsExporter
+{
+public:
+    using Source = std::function<std::string(MetricsFormat)>;
+
+    /*!
+     * \brief MetricsExporter starts serving
+     * \param port the TCP port to listen to on 127.0.0.1
+     * \param source returns the metrics in the format asked for, for instance with FormatMetrics
+     * \throw std::runtime_error if the port cannot be listened to
+     */
+    MetricsExporter(uint16_t port, Source source);
+    ~MetricsExporter();
+
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+private:
+    void Run();
+    void Serve(intptr_t connection);
+
+    const Source source_;
+    intptr_t listener_;
+    std::atomic_bool stopRequested_{ false };
+    std::thread thread_;
+};
@@ -5,27 +5,581 @@
 #include <grpcpp/alarm.h>
 #include <grpcpp/impl/codegen/async_stream.h> // for grpc::ServerAsyncWriter
 
-#include "Delegate.h"
-
-#include <boost/signals2/signal.hpp>
+#include "lrumap.h"
+#include "metrics.h"
+#include "notifications.hpp"
+#include "ringbuffer.h"
+#include "ServerOptions.h"
+#include "SubscriberRegistry.h"
+#include "tracing.h"
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iterator>
 #include <memory>
-#include <queue>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+// Threads running batches of tasks, with the thread handing a batch over helping
+// until all of its tasks are done.
+class TaskPool
+{
+public:
+    explicit TaskPool(size_t numThreads)
+    {
+        for (size_t i = 0; i < numThreads; ++i)
+        {
+            threads_.emplace_back(&TaskPool::Run, this);
+        }
+    }
+
+    ~TaskPool()
+    {
+        {
+            std::lock_guard<std::mutex> locker(mutex_);
+            stop_ = true;
+        }
+        taskAdded_.notify_all();
+        for (auto& thread : threads_)
+        {
+            thread.join();
+        }
+    }
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+    // Returns once all of tasks are done; runs them all if the pool has no threads.
+    void runAll(std::vector<std::function<void()>>& tasks)
+    {
+        if (tasks.empty())
+        {
+            return;
+        }
+        auto batch = std::make_shared<Batch>();
+        batch->remaining = tasks.size();
+        {
+            std::lock_guard<std::mutex> locker(mutex_);
+            for (auto& task : tasks)
+            {
+                tasks_.push_back({ std::move(task), batch });
+            }
+        }
+        tasks.clear();
+        taskAdded_.notify_all();
+
+        std::unique_lock<std::mutex> locker(mutex_);
+        while (batch->remaining > 0)
+        {
+            if (tasks_.empty())
+            {
+                taskDone_.wait(locker);
+                continue;
+            }
+            Execute(locker);
+        }
+    }
+
+private:
+    struct Batch
+    {
+        size_t remaining = 0;
+    };
+    struct Task
+    {
+        std::function<void()> run;
+        std::shared_ptr<Batch> batch;
+    };
+
+    void Run()
+    {
+        std::unique_lock<std::mutex> locker(mutex_);
+        for (;;)
+        {
+            taskAdded_.wait(locker, [this] { return stop_ || !tasks_.empty(); });
+            if (stop_)
+            {
+                return;
+            }
+            Execute(locker);
+        }
+    }
+
+    // Runs the first task, unlocking meanwhile.
+    void Execute(std::unique_lock<std::mutex>& locker)
+    {
+        auto task = std::move(tasks_.front());
+        tasks_.pop_front();
+        locker.unlock();
+        try {
+            task.run();
+        }
+        catch (const std::exception& ex) {
+            gpr_log(GPR_ERROR, "Task failed: %s", ex.what());
+        }
+        locker.lock();
+        if (--task.batch->remaining == 0)
+        {
+            taskDone_.notify_all();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable taskAdded_;
+    std::condition_variable taskDone_;
+    std::deque<Task> tasks_;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+};
 
 
 class ServerBase {
 public: 
+    explicit ServerBase(const ServerOptions& options)
+        : options_(options)
+        , encoders_(options.numEncodingThreads)
+        , traceHistograms_(options.trace ? std::make_unique<TraceHistograms>() : nullptr) {}
     virtual ~ServerBase() = default;
     virtual void RegisterService(grpc::ServerBuilder& builder) = 0;
 
-    void setAlarm(grpc::Alarm& alarm, void* tag) {
-        alarm.Set(cq_.get(), gpr_now(gpr_clock_type::GPR_CLOCK_REALTIME), tag);
+    static void setAlarm(grpc::Alarm& alarm, grpc::CompletionQueue* cq, void* tag) {
+        alarm.Set(cq, gpr_now(gpr_clock_type::GPR_CLOCK_REALTIME), tag);
+    }
+
+    // The alarm only fires when cancelled.
+    static void setIdleAlarm(grpc::Alarm& alarm, grpc::CompletionQueue* cq, void* tag) {
+        alarm.Set(cq, gpr_inf_future(gpr_clock_type::GPR_CLOCK_MONOTONIC), tag);
+    }
+
+    const ServerOptions options_;
+
+    // The metrics of the server as a whole, to which those of the subscribers are added.
+    ServerMetrics getMetrics() const
+    {
+        ServerMetrics result;
+        result.pushedMessages = pushedMessages_;
+        result.droppedMessages = droppedMessages_;
+        result.writeLatencyCount = writeLatencies_.count();
+        result.writeLatencySumUs = writeLatencies_.sum() * 1e-3;
+        result.writeLatencyP50Us = writeLatencies_.percentile(50) * 1e-3;
+        result.writeLatencyP99Us = writeLatencies_.percentile(99) * 1e-3;
+        result.wakeupLatencyCount = wakeupLatencies_.count();
+        result.wakeupLatencySumUs = wakeupLatencies_.sum() * 1e-3;
+        result.wakeupLatencyP50Us = wakeupLatencies_.percentile(50) * 1e-3;
+        result.wakeupLatencyP99Us = wakeupLatencies_.percentile(99) * 1e-3;
+        return result;
+    }
+
+    std::atomic<uint64_t> pushedMessages_ = 0;
+    std::atomic<uint64_t> droppedMessages_ = 0;
+    // In nanoseconds, across the subscribers.
+    LatencyHistogram writeLatencies_;
+    LatencyHistogram wakeupLatencies_;
+
+    // Set once the server is being destroyed: subscribers finish their call instead
+    // of writing or going idle.
+    std::atomic_bool stopping_ = false;
+
+    // Number of subscribers asking for object deltas, which are only worked out meanwhile.
+    std::atomic<size_t> numDeltaSubscribers_ = 0;
+
+    // Re-encode the images of the messages being dispatched, see Publication::prepare.
+    TaskPool encoders_;
+
+    // Null unless options_.trace.
+    const std::unique_ptr<TraceHistograms> traceHistograms_;
+};
+
+
+// How the images of the messages are sent to a subscriber.
+struct ImageEncoding
+{
+    ImageCodec codec = ImageCodec::NONE;
+    ImageScale scale = ImageScale::FULL;
+    ImageQuality quality = ImageQuality::ORIGINAL;
+
+    bool isOriginal() const
+    {
+        return codec == ImageCodec::NONE && !isReencoded();
+    }
+
+    // Whether the images are decoded to be scaled down or re-encoded, the costly part.
+    bool isReencoded() const
+    {
+        return scale != ImageScale::FULL || quality != ImageQuality::ORIGINAL;
     }
 
-    std::unique_ptr<grpc::ServerCompletionQueue> cq_;
+    bool operator==(const ImageEncoding& other) const
+    {
+        return codec == other.codec && scale == other.scale && quality == other.quality;
+    }
+};
+
+
+// Messages are serialized once by the publisher and the resulting buffer is shared
+// by all the subscribers; a grpc::ByteBuffer copy only takes slice references.
+struct Publication
+{
+    grpc::ByteBuffer buffer;
+    size_t size = 0;
+    // The fov_id: subscribers are indexed by it, and messages with the same key
+    // supersede each other, see OverflowPolicy::COALESCE_LATEST.
+    std::string key;
+    uint64_t sduId = 0;
+    // Number of the event, unique among those pushed while some subscriber asks for
+    // object deltas; 0 otherwise and for the other messages.
+    uint64_t sequence = 0;
+    // Number of the event of the same fov_id the objects may be sent as a delta against,
+    // 0 if none.
+    uint64_t deltaBase = 0;
+    // The labels the message refers to, see Fov::Label.
+    std::vector<InternedString> labels;
+    // When the message was pushed and serialized, see TraceNow.
+    uint64_t pushedNs = 0;
+    uint64_t serializedNs = 0;
+    // Builds the message with its images encoded otherwise, or with its objects as a
+    // delta; empty if there is nothing to build.
+    std::function<grpc::ByteBuffer(const ImageEncoding& encoding, bool delta)> encode;
+    // Does the costly part of building the variants for encoding, re-encoding the images,
+    // ahead of get; empty if there is nothing to do. Run on ServerBase::encoders_ before
+    // dispatching, so that the completion queue threads calling get are not held back
+    // decoding images.
+    std::function<void(const ImageEncoding& encoding)> prepare;
+
+    // Each variant is built lazily, once, whatever the number of subscribers wanting it.
+    const grpc::ByteBuffer& get(const ImageEncoding& encoding, bool delta = false) const
+    {
+        delta = delta && deltaBase != 0;
+        if ((encoding.isOriginal() && !delta) || !encode)
+        {
+            return buffer;
+        }
+
+        Variant* variant;
+        {
+            std::lock_guard<std::mutex> locker(variantsMutex_);
+            auto it = std::find_if(variants_.begin(), variants_.end(),
+                [&encoding, delta](const auto& v) { return v->encoding == encoding && v->delta == delta; });
+            if (it == variants_.end())
+            {
+                variants_.push_back(std::make_unique<Variant>());
+                variants_.back()->encoding = encoding;
+                variants_.back()->delta = delta;
+                it = std::prev(variants_.end());
+            }
+            variant = it->get();
+        }
+        // Other variants may be built meanwhile.
+        std::call_once(variant->once, [this, variant] { variant->buffer = encode(variant->encoding, variant->delta); });
+        return variant->buffer;
+    }
+
+private:
+    struct Variant
+    {
+        ImageEncoding encoding;
+        bool delta = false;
+        std::once_flag once;
+        grpc::ByteBuffer buffer;
+    };
+    mutable std::mutex variantsMutex_;
+    mutable std::vector<std::unique_ptr<Variant>> variants_;
+};
+
+using SerializedMessage = std::shared_ptr<const Publication>;
+
+
+// Protobuf wire format, for composing messages out of serialized pieces.
+
+inline void AppendVarint(std::string& dst, uint64_t value)
+{
+    for (; value >= 0x80; value >>= 7)
+    {
+        dst.push_back(static_cast<char>(value | 0x80));
+    }
+    dst.push_back(static_cast<char>(value));
+}
+
+inline void AppendLengthDelimitedTag(std::string& dst, int fieldNumber)
+{
+    enum { WIRETYPE_LENGTH_DELIMITED = 2 };
+    AppendVarint(dst, (static_cast<uint64_t>(fieldNumber) << 3) | WIRETYPE_LENGTH_DELIMITED);
+}
+
+inline void AppendFixed64(std::string& dst, int fieldNumber, uint64_t value)
+{
+    enum { WIRETYPE_FIXED64 = 1 };
+    AppendVarint(dst, (static_cast<uint64_t>(fieldNumber) << 3) | WIRETYPE_FIXED64);
+    for (int i = 0; i < 8; ++i)
+    {
+        dst.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+// The field of the EventBatch and NotifyBatch messages holding the batched messages.
+enum { kBatchFieldNumber = 1 };
+
+// The field of the Event and Notify messages defining labels, and those of Fov::Label.
+enum { kLabelsFieldNumber = 16, kLabelIdFieldNumber = 1, kLabelTextFieldNumber = 2 };
+
+// Appends the definition of label as a kLabelsFieldNumber field.
+inline void AppendLabel(std::string& dst, const InternedString& label)
+{
+    enum { WIRETYPE_VARINT = 0 };
+    std::string definition;
+    AppendVarint(definition, (kLabelIdFieldNumber << 3) | WIRETYPE_VARINT);
+    AppendVarint(definition, label.id());
+    AppendLengthDelimitedTag(definition, kLabelTextFieldNumber);
+    AppendVarint(definition, label.str().size());
+    definition += label.str();
+
+    AppendLengthDelimitedTag(dst, kLabelsFieldNumber);
+    AppendVarint(dst, definition.size());
+    dst += definition;
+}
+
+// The field of the Event and Notify messages holding the trace, and those of Fov::Trace.
+enum { kTraceFieldNumber = 17, kTracePushedFieldNumber = 1, kTraceSerializedFieldNumber = 2, kTraceDequeuedFieldNumber = 3 };
+
+// Appends the server stages of stamps as a kTraceFieldNumber field.
+inline void AppendTrace(std::string& dst, const TraceStamps& stamps)
+{
+    std::string trace;
+    AppendFixed64(trace, kTracePushedFieldNumber, stamps[TraceStage::PUSHED]);
+    AppendFixed64(trace, kTraceSerializedFieldNumber, stamps[TraceStage::SERIALIZED]);
+    AppendFixed64(trace, kTraceDequeuedFieldNumber, stamps[TraceStage::DEQUEUED]);
+
+    AppendLengthDelimitedTag(dst, kTraceFieldNumber);
+    AppendVarint(dst, trace.size());
+    dst += trace;
+}
+
+
+// Bounded queue of the messages waiting to be written to a subscriber.
+// An empty queue accepts any message, however large.
+// Publishers push into a lock-free ring, dropping from its front themselves if
+// needed; coalescing happens on the consumer side, which is the only one to pop
+// into the pending_ list.
+class SubscriberQueue
+{
+public:
+    explicit SubscriberQueue(const ServerOptions& options)
+        : ring_(std::max<size_t>(options.maxQueuedMessages, 1))
+        , maxBytes_(options.maxQueuedBytes)
+        , policy_(options.overflowPolicy)
+    {
+    }
+
+    // Must be called before the first push.
+    void setPolicy(OverflowPolicy policy) { policy_ = policy; }
+
+    // May be called concurrently. Returns the number of messages dropped.
+    size_t push(const SerializedMessage& message)
+    {
+        // Counted upfront, so that a concurrent pop never makes bytes_ wrap around.
+        const size_t bytes = bytes_.fetch_add(message->size) + message->size;
+
+        if (policy_ == OverflowPolicy::DROP_NEWEST)
+        {
+            if ((bytes > maxBytes_ && bytes != message->size) || !ring_.push(message))
+            {
+                bytes_ -= message->size;
+                return 1;
+            }
+            return 0;
+        }
+
+        size_t dropped = 0;
+        SerializedMessage oldest;
+        while (bytes_ > maxBytes_ && ring_.pop(oldest))
+        {
+            bytes_ -= oldest->size;
+            ++dropped;
+        }
+        while (!ring_.push(message))
+        {
+            if (ring_.pop(oldest))
+            {
+                bytes_ -= oldest->size;
+                ++dropped;
+            }
+        }
+        return dropped;
+    }
+
+    // Consumer side. dropped is increased by the number of messages coalesced.
+    bool pop(SerializedMessage& message, size_t& dropped)
+    {
+        if (policy_ != OverflowPolicy::COALESCE_LATEST)
+        {
+            if (!ring_.pop(message))
+            {
+                return false;
+            }
+            bytes_ -= message->size;
+            return true;
+        }
+
+        SerializedMessage next;
+        while (ring_.pop(next))
+        {
+            auto it = std::find_if(pending_.begin(), pending_.end(),
+                [&next](const SerializedMessage& v) { return v->key == next->key; });
+            if (it != pending_.end())
+            {
+                bytes_ -= (*it)->size;
+                *it = std::move(next);
+                ++dropped;
+            }
+            else
+            {
+                pending_.push_back(std::move(next));
+            }
+        }
+        while (pending_.size() > 1 && (pending_.size() > ring_.capacity() || bytes_ > maxBytes_))
+        {
+            bytes_ -= pending_.front()->size;
+            pending_.pop_front();
+            ++dropped;
+        }
+
+        if (pending_.empty())
+        {
+            numPending_.store(0, std::memory_order_relaxed);
+            return false;
+        }
+        message = std::move(pending_.front());
+        pending_.pop_front();
+        numPending_.store(pending_.size(), std::memory_order_relaxed);
+        bytes_ -= message->size;
+        return true;
+    }
+
+    // May be called concurrently with the consumer.
+    bool hasPushed() const { return !ring_.empty(); }
+
+    // May be called from any thread; approximate while messages come and go.
+    size_t size() const { return ring_.size() + numPending_.load(std::memory_order_relaxed); }
+    size_t bytes() const { return bytes_; }
+
+private:
+    RingBuffer<SerializedMessage> ring_;
+    std::deque<SerializedMessage> pending_;
+    // pending_.size(), for the other threads.
+    std::atomic<size_t> numPending_ = 0;
+    std::atomic<size_t> bytes_ = 0;
+
+    const size_t maxBytes_;
+    OverflowPolicy policy_;
+};
+
+
+// Hands the published messages over to a thread fanning them out to the subscribers,
+// so that publishing costs the same whatever the number of subscribers. Messages
+// are fanned out in batches of whatever has been pushed in the meantime.
+class Dispatcher
+{
+public:
+    typedef std::function<void(const SerializedMessage* messages, size_t count)> FanOut;
+
+    Dispatcher(ServerBase* parent, FanOut fanOut)
+        : parent_(parent)
+        , fanOut_(std::move(fanOut))
+        , ring_(std::max<size_t>(parent->options_.maxPendingPublications, 1))
+        , thread_(&Dispatcher::Run, this)
+    {
+    }
+
+    ~Dispatcher()
+    {
+        {
+            std::lock_guard<std::mutex> locker(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_one();
+        thread_.join();
+    }
+
+    // Never blocks on the fan-out; the oldest pending messages are dropped if needed.
+    void push(const SerializedMessage* messages, size_t count)
+    {
+        parent_->pushedMessages_.fetch_add(count, std::memory_order_relaxed);
+        SerializedMessage oldest;
+        for (size_t i = 0; i < count; ++i)
+        {
+            while (!ring_.push(messages[i]))
+            {
+                if (ring_.pop(oldest))
+                {
+                    ++parent_->droppedMessages_;
+                }
+            }
+        }
+
+        // Pairs with the fence in Run.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_)
+        {
+            std::lock_guard<std::mutex> locker(mutex_);
+            cv_.notify_one();
+        }
+    }
+
+    void push(const SerializedMessage& message) { push(&message, 1); }
+
+    // Number of messages waiting to be fanned out.
+    size_t size() const { return ring_.size(); }
+
+private:
+    void Run()
+    {
+        std::vector<SerializedMessage> batch;
+        batch.reserve(ring_.capacity());
+        for (;;)
+        {
+            SerializedMessage message;
+            while (batch.size() < ring_.capacity() && ring_.pop(message))
+            {
+                batch.push_back(std::move(message));
+            }
+            if (!batch.empty())
+            {
+                fanOut_(batch.data(), batch.size());
+                batch.clear();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> locker(mutex_);
+            sleeping_ = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            cv_.wait(locker, [this] { return stop_ || !ring_.empty(); });
+            sleeping_ = false;
+            if (stop_)
+            {
+                return;
+            }
+        }
+    }
+
+    ServerBase* parent_;
+    FanOut fanOut_;
+    RingBuffer<SerializedMessage> ring_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::atomic_bool sleeping_ = false;
+    bool stop_ = false;
+
+    std::thread thread_;
 };
 
 
@@ -38,38 +592,75 @@ public:
 
 class ServerImpl : public ServerBase {
 public:
-    ServerImpl(const std::string& serverIpAddress) : serverIpAddress_(serverIpAddress) {
+    ServerImpl(const std::string& serverIpAddress, const ServerOptions& options)
+        : ServerBase(options), serverIpAddress_(serverIpAddress) {
     }
 
     ~ServerImpl() override {
-        shutdownFlag_ = true;
-
-        server_->Shutdown();
-        // Always shutdown the completion queue after the server.
-        cq_->Shutdown();
-
-        // join
-        thread_.join();
-
-        // drain the queue
-        void* ignoredTag = nullptr;
-        bool ok = false;
-        while (cq_->Next(&ignoredTag, &ok)) {
-            ;
-        }
+        Stop();
     }
 
     void RunAsync() {
-        thread_ = std::thread([this] { Run(); });
+        Run();
     }
 
 protected:
-    virtual void initCallData() = 0;
+    // Spawns the call data waiting for new clients on cq.
+    virtual void initCallData(grpc::ServerCompletionQueue* cq) = 0;
+
+    // Wakes every idle subscriber up, see CallDataTemplate::WakeAll.
+    virtual void wakeSubscribers() = 0;
+
+    // Must be called from the most derived destructor, while the services and
+    // subscriber registries the call data refer to are still alive.
+    void Stop() {
+        if (threads_.empty()) {
+            return;
+        }
+
+        // Subscribers are waiting for messages or writing them until their client
+        // leaves, so they are told to finish: idle ones are woken up and the others
+        // see stopping_ as their operation completes. Pairs with the fence in
+        // CallDataTemplate::WriteOrWait.
+        stopping_ = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wakeSubscribers();
+
+        // With no deadline, the shutdown would wait for the calls to end by themselves,
+        // which a write to a stalled client or a credited call waiting for a grant
+        // never does. An immediate deadline cancels them, so that their pending
+        // operations complete with ok == false.
+        server_->Shutdown(std::chrono::system_clock::now());
+
+        // Always shutdown the completion queues after the server. This is done by
+        // HandleRpcs, so wake them up.
+        shutdownFlag_ = true;
+        for (auto& queue : queues_) {
+            // A queue may already have been shut down by a completion arriving meanwhile.
+            std::unique_lock<std::shared_mutex> locker(queue->mutex);
+            if (!queue->isShutdown) {
+                setAlarm(queue->shutdownAlarm, queue->cq.get(), nullptr);
+            }
+        }
+
+        // join
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+        threads_.clear();
+    }
 
 private:
     //friend class SubscriberCallData;
 
-    // There is no shutdown handling in this code.
+    struct Queue {
+        std::unique_ptr<grpc::ServerCompletionQueue> cq;
+        // Held shared while proceeding and exclusively to shut the queue down.
+        std::shared_mutex mutex;
+        bool isShutdown = false;
+        grpc::Alarm shutdownAlarm;
+    };
+
     void Run() {
         grpc::ServerBuilder builder;
 
@@ -88,34 +679,61 @@ private:
         // clients. In this case it corresponds to an *asynchronous* service.
         RegisterService(builder);
 
-        // Get hold of the completion queue used for the asynchronous communication
-        // with the gRPC runtime.
-        cq_ = builder.AddCompletionQueue();
+        // Get hold of the completion queues used for the asynchronous communication
+        // with the gRPC runtime. New calls are spread across the queues waiting for them.
+        const auto numQueues = std::max<size_t>(options_.numCompletionQueues, 1);
+        for (size_t i = 0; i < numQueues; ++i) {
+            queues_.push_back(std::make_unique<Queue>());
+            queues_.back()->cq = builder.AddCompletionQueue();
+        }
         // Finally assemble the server.
         server_ = builder.BuildAndStart();
 
-        // Proceed to the server's main loop.
-        HandleRpcs();
-    }
-
+        for (auto& queue : queues_) {
+            initCallData(queue->cq.get());
+        }
 
-    // This can be run in multiple threads if needed.
-    void HandleRpcs() {
-        // Spawn a new CallData instance to serve new clients.
-        //new SubscriberCallData(this);
+        // Proceed to the server's main loops.
+        const auto numThreads = std::max<size_t>(options_.numThreadsPerQueue, 1);
+        for (auto& queue : queues_) {
+            for (size_t i = 0; i < numThreads; ++i) {
+                threads_.emplace_back([this, pQueue = queue.get()] { HandleRpcs(*pQueue); });
+            }
+        }
+    }
 
-        initCallData();
 
+    // Run in options_.numThreadsPerQueue threads per queue. Every call data has at
+    // most one pending operation, so its Proceed is never run concurrently.
+    void HandleRpcs(Queue& queue) {
         void* tag;  // uniquely identifies a request.
         bool ok;
-        while (cq_->Next(&tag, &ok)) {
+        while (queue.cq->Next(&tag, &ok)) {
             // Block waiting to read the next event from the completion queue. The
             // event is uniquely identified by its tag, which in this case is the
             // memory address of a CallData instance.
             // The return value of Next should always be checked. This return value
             // tells us whether there is any kind of event or cq_ is shutting down.
             //GPR_ASSERT(ok);
-            static_cast<CallData*>(tag)->Proceed(ok && !shutdownFlag_);
+            {
+                std::shared_lock<std::shared_mutex> locker(queue.mutex);
+                if (!shutdownFlag_) {
+                    static_cast<CallData*>(tag)->Proceed(ok);
+                    continue;
+                }
+            }
+
+            // No operation may be started once the queue is shut down, so call data
+            // are just deleted as their pending operations complete, until the queue
+            // is drained.
+            {
+                std::unique_lock<std::shared_mutex> locker(queue.mutex);
+                if (!queue.isShutdown) {
+                    queue.cq->Shutdown();
+                    queue.isShutdown = true;
+                }
+            }
+            delete static_cast<CallData*>(tag);
         }
     }
     
@@ -124,7 +742,9 @@ private:
 
     std::unique_ptr<grpc::Server> server_;
 
-    std::thread thread_;
+    std::vector<std::unique_ptr<Queue>> queues_;
+
+    std::vector<std::thread> threads_;
 
     std::atomic_bool shutdownFlag_ = false;
 };
@@ -135,17 +755,25 @@ private:
 
 
 // Class encompasing the state and logic needed to serve a request.
-template <typename E, typename C, typename P, typename S>
+// S is a service with raw Subscribe, SubscribeBatch and the WithCredit variants of
+// these, so that the pre-serialized messages can be written as is; C is the request type.
+template <typename C, typename S>
 class CallDataTemplate : public CallData {
 public:
     // Take in the "service" instance (in this case representing an asynchronous
     // server) and the completion queue "cq" used for asynchronous communication
     // with the gRPC runtime.
-    CallDataTemplate(boost::signals2::signal<void(const P&)>& observer, ServerBase* parent, S& service)
-        : observer_(observer)
+    // A batched call serves SubscribeBatch, a credited one the WithCredit variant.
+    CallDataTemplate(SubscriberRegistry<CallDataTemplate>& subscribers, ServerBase* parent, S& service,
+            grpc::ServerCompletionQueue* cq, bool batched, bool credited = false)
+        : subscribers_(subscribers)
         , parent_(parent)
+        , cq_(cq)
         , subscriberService_(service)
-        , responder_(&ctx_), status_(CREATE) {
+        , responder_(&ctx_), stream_(&ctx_), status_(CREATE)
+        , fifo_(parent->options_)
+        , batched_(batched)
+        , credited_(credited) {
         // Invoke the serving logic right away.
         Proceed(true);
     }
@@ -153,7 +781,14 @@ public:
     ~CallDataTemplate()
     {
         if (started_) {
-            observer_.disconnect(MakeDelegate<&CallDataTemplate::HandleNotification>(this));
+            // Waits for the dispatcher if it is calling Enqueue or Wake.
+            subscribers_.remove(this);
+            if (objectDeltas_) {
+                --parent_->numDeltaSubscribers_;
+            }
+        }
+        if (numDropped_ > 0) {
+            gpr_log(GPR_INFO, "Subscriber dropped messages: %llu", static_cast<unsigned long long>(numDropped_.load()));
         }
     }
 
@@ -167,8 +802,20 @@ public:
             // the tag uniquely identifying the request (so that different CallData
             // instances can serve different requests concurrently), in this case
             // the memory address of this CallData instance.
-            auto cq = parent_->cq_.get();
-            subscriberService_.RequestSubscribe(&ctx_, &request_, &responder_, cq, cq, this);
+            if (credited_) {
+                if (batched_) {
+                    subscriberService_.RequestSubscribeBatchWithCredit(&ctx_, &stream_, cq_, cq_, this);
+                }
+                else {
+                    subscriberService_.RequestSubscribeWithCredit(&ctx_, &stream_, cq_, cq_, this);
+                }
+            }
+            else if (batched_) {
+                subscriberService_.RequestSubscribeBatch(&ctx_, &rawRequest_, &responder_, cq_, cq_, this);
+            }
+            else {
+                subscriberService_.RequestSubscribe(&ctx_, &rawRequest_, &responder_, cq_, cq_, this);
+            }
         }
         else if (status_ == PROCESS) {
             // Spawn a new CallData instance to serve new clients while we process
@@ -182,61 +829,136 @@ public:
                     return;
                 }
 
-                new CallDataTemplate(observer_, parent_, subscriberService_);
-
-                // subscribe to notifications
-                observer_.connect(MakeDelegate<&CallDataTemplate::HandleNotification>(this));
+                new CallDataTemplate(subscribers_, parent_, subscriberService_, cq_, batched_, credited_);
 
-                started_ = true;
+                if (credited_)
+                {
+                    // The request is the first message of the stream.
+                    status_ = READ;
+                    stream_.Read(&rawRequest_, this);
+                    return;
+                }
+                Start();
             }
 
             // The actual processing.
 
-            response_.Clear();
-
             // AsyncNotifyWhenDone?
             if (!ok)
             {
                 status_ = FINISH;
-                responder_.Finish(grpc::Status(), this);
+                Finish();
             }
             else
             {
-                bool hasNotification = false;
+                WriteOrWait();
+            }
+        }
+        else if (status_ == READ)
+        {
+            if (!ok)
+            {
+                // The client is gone, or has closed its side of the stream.
+                status_ = FINISH;
+                Finish();
+                return;
+            }
+            if (!started_)
+            {
+                Start();
+                windowMessages_ = request_.credit().messages();
+                windowBytes_ = request_.credit().bytes();
+            }
+            else
+            {
+                C grant;
+                grpc::SerializationTraits<C>::Deserialize(&rawRequest_, &grant);
+                Grant(grant.credit().granted());
+            }
+            status_ = PROCESS;
+            WriteOrWait();
+        }
+        else if (status_ == IDLE)
+        {
+            // The alarm has either expired or been cancelled by Wake, so ok
+            // carries no error information here.
+            for (;;)
+            {
+                int state = wakeState_.load(std::memory_order_acquire);
+                if (state == WAKE_IDLE)
                 {
-                    std::lock_guard<std::mutex> locker(fifoMutex_);
-                    if (!fifo_.empty())
+                    // Expired: make sure that no publisher touches the alarm from now on.
+                    if (wakeState_.compare_exchange_weak(state, WAKE_BUSY))
                     {
-                        hasNotification = true;
-                        response_ = AsFoi(fifo_.front());
-                        fifo_.pop();
+                        break;
                     }
                 }
-
-                if (hasNotification)
+                else if (state == WAKE_BUSY)
                 {
-                    responder_.Write(response_, this);
-                    // https://www.gresearch.co.uk/2019/03/20/lessons-learnt-from-writing-asynchronous-streaming-grpc-services-in-c/
-                    status_ = PUSH_TO_BACK;
+                    break;
                 }
                 else
                 {
-                    // https://www.gresearch.co.uk/2019/03/20/lessons-learnt-from-writing-asynchronous-streaming-grpc-services-in-c/
-                    parent_->setAlarm(alarm_, this);
+                    // Another thread is about to be done with the alarm.
+                    std::this_thread::yield();
                 }
             }
+
+            uint64_t wakeupRequested = 0;
+            std::swap(wakeupRequested, wakeupRequested_);
+
+            if (wakeupRequested != 0)
+            {
+                const auto latency = TraceNow() - wakeupRequested;
+                parent_->wakeupLatencies_.record(latency);
+                // Only this thread writes these.
+                numWakeups_.store(numWakeups_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                totalWakeupLatency_.store(totalWakeupLatency_.load(std::memory_order_relaxed) + latency,
+                    std::memory_order_relaxed);
+                if (latency > maxWakeupLatency_.load(std::memory_order_relaxed))
+                {
+                    maxWakeupLatency_.store(latency, std::memory_order_relaxed);
+                }
+            }
+
+            status_ = PROCESS;
+            WriteOrWait();
         }
         else if (status_ == PUSH_TO_BACK)
         {
+            const auto writtenNs = TraceNow();
+            const auto writeLatency = writtenNs - writeStarted_;
+            parent_->writeLatencies_.record(writeLatency);
+            // Only this thread writes these.
+            numWrites_.store(numWrites_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            totalWriteLatency_.store(totalWriteLatency_.load(std::memory_order_relaxed) + writeLatency,
+                std::memory_order_relaxed);
+            if (writeLatency > maxWriteLatency_.load(std::memory_order_relaxed))
+            {
+                maxWriteLatency_.store(writeLatency, std::memory_order_relaxed);
+            }
+            if (ok)
+            {
+                for (auto& stamps : writing_)
+                {
+                    stamps[TraceStage::WRITTEN] = writtenNs;
+                    parent_->traceHistograms_->record(stamps);
+                }
+            }
+            writing_.clear();
+
             if (!ok)
             {
                 status_ = FINISH;
-                responder_.Finish(grpc::Status(), this);
+                Finish();
             }
             else
             {
+                // Go on writing right away. Only one write may be outstanding, and
+                // buffer hints are not used: a buffered write is not flushed until the
+                // next one, which would wait for its completion.
                 status_ = PROCESS;
-                parent_->setAlarm(alarm_, this);
+                WriteOrWait();
             }
         }
         else {
@@ -246,19 +968,428 @@ public:
         }
     }
 
-    void HandleNotification(const P& notification)
+    // Called by the dispatcher: queues each message to the subscribers to its key
+    // accepting it, then wakes each of these up once. Takes no subscriber lock.
+    static void Dispatch(const SubscriberRegistry<CallDataTemplate>& subscribers, TaskPool& encoders,
+        const SerializedMessage* notifications, size_t count)
+    {
+        Prepare(subscribers, encoders, notifications, count);
+
+        static thread_local std::vector<CallDataTemplate*> touched;
+        subscribers.read([notifications, count](const auto& snapshot) {
+            for (size_t i = 0; i < count; ++i)
+            {
+                const auto& notification = notifications[i];
+                snapshot.forEach(notification->key, [&notification](CallDataTemplate* subscriber) {
+                    if (subscriber->Accepts(*notification))
+                    {
+                        subscriber->Enqueue(notification);
+                        if (!subscriber->touched_)
+                        {
+                            subscriber->touched_ = true;
+                            touched.push_back(subscriber);
+                        }
+                    }
+                });
+            }
+
+            // Pairs with the fence in WriteOrWait: either the dispatcher sees the call
+            // going idle or the call sees the messages.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            for (auto subscriber : touched)
+            {
+                subscriber->touched_ = false;
+                subscriber->Wake();
+            }
+        });
+        touched.clear();
+    }
+
+    // Re-encodes the images of the messages as their subscribers ask for, once per
+    // message and tier, in parallel. The subscribers are only looked up in the read
+    // section, which would otherwise hold back those coming and going. Subscribers
+    // coming meanwhile have their tier built by the first Serialize wanting it.
+    static void Prepare(const SubscriberRegistry<CallDataTemplate>& subscribers, TaskPool& encoders,
+        const SerializedMessage* notifications, size_t count)
     {
-        std::lock_guard<std::mutex> locker(fifoMutex_);
-        fifo_.push(notification);
+        static thread_local std::vector<std::pair<SerializedMessage, ImageEncoding>> tiers;
+        subscribers.read([notifications, count](const auto& snapshot) {
+            for (size_t i = 0; i < count; ++i)
+            {
+                const auto& notification = notifications[i];
+                if (!notification->prepare)
+                {
+                    continue;
+                }
+                const auto first = tiers.size();
+                snapshot.forEach(notification->key, [&notification, first](CallDataTemplate* subscriber) {
+                    if (!subscriber->imageEncoding_.isReencoded() || !subscriber->Accepts(*notification))
+                    {
+                        return;
+                    }
+                    // The codec is applied by get, on the tier.
+                    ImageEncoding tier = subscriber->imageEncoding_;
+                    tier.codec = ImageCodec::NONE;
+                    if (std::none_of(tiers.begin() + first, tiers.end(), [&tier](const auto& v) { return v.second == tier; }))
+                    {
+                        tiers.emplace_back(notification, tier);
+                    }
+                });
+            }
+        });
+
+        static thread_local std::vector<std::function<void()>> tasks;
+        for (auto& v : tiers)
+        {
+            tasks.push_back([notification = std::move(v.first), tier = v.second] { notification->prepare(tier); });
+        }
+        tiers.clear();
+        encoders.runAll(tasks);
+    }
+
+    // Called by the server being destroyed, once stopping_ is set.
+    static void WakeAll(const SubscriberRegistry<CallDataTemplate>& subscribers)
+    {
+        subscribers.read([](const auto& snapshot) {
+            snapshot.forAll([](CallDataTemplate* subscriber) {
+                subscriber->Wake();
+            });
+        });
+    }
+
+    // Adds the metrics of the subscribers to metrics.
+    static void CollectMetrics(const SubscriberRegistry<CallDataTemplate>& subscribers, ServerMetrics& metrics)
+    {
+        subscribers.read([&metrics](const auto& snapshot) {
+            snapshot.forAll([&metrics](const CallDataTemplate* subscriber) {
+                metrics.subscribers.push_back(subscriber->GetMetrics());
+            });
+        });
     }
 
 private:
-    boost::signals2::signal<void(const P&)>& observer_;
+    // Applies request_, read into rawRequest_, and subscribes to the messages.
+    void Start()
+    {
+        grpc::SerializationTraits<C>::Deserialize(&rawRequest_, &request_);
+        if (request_.overflow_policy() != 0) {
+            fifo_.setPolicy(static_cast<OverflowPolicy>(request_.overflow_policy()));
+        }
+        if (request_.image_codec() == static_cast<int>(ImageCodec::DEFLATE)) {
+            imageEncoding_.codec = ImageCodec::DEFLATE;
+        }
+        if (request_.image_scale() >= 0 && request_.image_scale() <= static_cast<int>(ImageScale::QUARTER)) {
+            imageEncoding_.scale = static_cast<ImageScale>(request_.image_scale());
+        }
+        if (request_.image_quality() >= 0 && request_.image_quality() <= static_cast<int>(ImageQuality::LOW)) {
+            imageEncoding_.quality = static_cast<ImageQuality>(request_.image_quality());
+        }
+        if (request_.gzip()) {
+            ctx_.set_compression_algorithm(GRPC_COMPRESS_GZIP);
+        }
+        objectDeltas_ = request_.object_deltas();
+        if (objectDeltas_) {
+            ++parent_->numDeltaSubscribers_;
+        }
+        trace_ = request_.trace();
+        peer_ = ctx_.peer();
+
+        // subscribe to notifications
+        sduIds_.assign(request_.sdu_ids().begin(), request_.sdu_ids().end());
+        std::sort(sduIds_.begin(), sduIds_.end());
+        subscribers_.add(this, { request_.fov_ids().begin(), request_.fov_ids().end() });
+
+        started_ = true;
+    }
+
+    void Write(const grpc::ByteBuffer& buffer)
+    {
+        if (credited_) {
+            stream_.Write(buffer, this);
+        }
+        else {
+            responder_.Write(buffer, this);
+        }
+    }
+
+    void Finish()
+    {
+        if (credited_) {
+            stream_.Finish(grpc::Status(), this);
+        }
+        else {
+            responder_.Finish(grpc::Status(), this);
+        }
+    }
+
+    // Whether the client lets another message be written, see Fov::Credit.
+    bool HasCredit() const
+    {
+        return !credited_
+            || ((windowMessages_ == 0 || inFlight_.size() < windowMessages_)
+                && (windowBytes_ == 0 || inFlightBytes_ < windowBytes_));
+    }
+
+    // Counts a message of size bytes as in flight until granted back.
+    void Charge(size_t size)
+    {
+        if (credited_)
+        {
+            inFlight_.push_back(size);
+            inFlightBytes_ += size;
+        }
+    }
+
+    void Grant(size_t numMessages)
+    {
+        for (; numMessages > 0 && !inFlight_.empty(); --numMessages)
+        {
+            inFlightBytes_ -= inFlight_.front();
+            inFlight_.pop_front();
+        }
+    }
+
+    // May be called from any thread while the subscriber is registered.
+    SubscriberMetrics GetMetrics() const
+    {
+        SubscriberMetrics result;
+        result.id = request_.id();
+        result.peer = peer_;
+        result.queuedMessages = fifo_.size();
+        result.queuedBytes = fifo_.bytes();
+        result.writtenMessages = numWrittenMessages_.load(std::memory_order_relaxed);
+        result.writtenBytes = numWrittenBytes_.load(std::memory_order_relaxed);
+        result.droppedMessages = numDropped_;
+        const auto numWrites = numWrites_.load(std::memory_order_relaxed);
+        if (numWrites > 0)
+        {
+            result.meanWriteLatencyUs = totalWriteLatency_.load(std::memory_order_relaxed) * 1e-3 / numWrites;
+        }
+        result.maxWriteLatencyUs = maxWriteLatency_.load(std::memory_order_relaxed) * 1e-3;
+        result.wakeups = numWakeups_.load(std::memory_order_relaxed);
+        if (result.wakeups > 0)
+        {
+            result.meanWakeupLatencyUs = totalWakeupLatency_.load(std::memory_order_relaxed) * 1e-3 / result.wakeups;
+        }
+        result.maxWakeupLatencyUs = maxWakeupLatency_.load(std::memory_order_relaxed) * 1e-3;
+        result.objectDeltaStreams = numDeltaStreams_.load(std::memory_order_relaxed);
+        return result;
+    }
+
+    bool Accepts(const Publication& notification) const
+    {
+        return sduIds_.empty() || std::binary_search(sduIds_.begin(), sduIds_.end(), notification.sduId);
+    }
+
+    void Enqueue(const SerializedMessage& notification)
+    {
+        if (const auto dropped = fifo_.push(notification))
+        {
+            numDropped_ += dropped;
+            parent_->droppedMessages_ += dropped;
+        }
+    }
+
+    void Wake()
+    {
+        int state = wakeState_.load();
+        for (;;)
+        {
+            if (state == WAKE_IDLE)
+            {
+                if (wakeState_.compare_exchange_weak(state, WAKE_CANCELLING))
+                {
+                    // Fires the pending alarm right away with ok == false.
+                    wakeupRequested_ = TraceNow();
+                    alarm_.Cancel();
+                    wakeState_.store(WAKE_BUSY, std::memory_order_release);
+                    return;
+                }
+            }
+            else if (state == WAKE_ARMING)
+            {
+                // Let WriteOrWait cancel the alarm it is setting.
+                if (wakeState_.compare_exchange_weak(state, WAKE_REQUESTED))
+                {
+                    return;
+                }
+            }
+            else
+            {
+                // Busy: the queue is looked at again before going idle.
+                return;
+            }
+        }
+    }
+
+    void WriteOrWait()
+    {
+        response_.reset();
+
+        if (parent_->stopping_)
+        {
+            // The server is being destroyed.
+            status_ = FINISH;
+            Finish();
+            return;
+        }
+
+        if (!HasCredit())
+        {
+            // Wait for the client to grant credit back; meanwhile the messages are
+            // queued under the overflow policy, as for a slow subscriber.
+            status_ = READ;
+            stream_.Read(&rawRequest_, this);
+            return;
+        }
+
+        size_t dropped = 0;
+        const bool hasNotification = fifo_.pop(response_, dropped);
+        if (hasNotification && batched_)
+        {
+            MakeBatch(dropped);
+        }
+        if (dropped > 0)
+        {
+            numDropped_ += dropped;
+            parent_->droppedMessages_ += dropped;
+        }
+
+        if (hasNotification)
+        {
+            // The state must be changed first, another thread may handle the completion.
+            // https://www.gresearch.co.uk/2019/03/20/lessons-learnt-from-writing-asynchronous-streaming-grpc-services-in-c/
+            status_ = PUSH_TO_BACK;
+            const auto& buffer = batched_ ? batch_ : Serialize(*response_);
+            if (!batched_)
+            {
+                Charge(buffer.Length());
+            }
+            numWrittenBytes_.store(numWrittenBytes_.load(std::memory_order_relaxed) + buffer.Length(),
+                std::memory_order_relaxed);
+            writeStarted_ = TraceNow();
+            Write(buffer);
+            return;
+        }
+
+        // Nothing to send: sleep until Wake cancels the alarm, which never expires.
+        // Publishers leave the alarm alone until it is set, then the call may be
+        // resumed by another thread at any moment, so nothing is touched afterwards.
+        status_ = IDLE;
+        wakeState_.store(WAKE_ARMING);
+        parent_->setIdleAlarm(alarm_, cq_, this);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int state = WAKE_ARMING;
+        if (fifo_.hasPushed() || parent_->stopping_ || !wakeState_.compare_exchange_strong(state, WAKE_IDLE))
+        {
+            // Something has been pushed or the server is stopping in the meantime.
+            alarm_.Cancel();
+            wakeState_.store(WAKE_BUSY, std::memory_order_release);
+        }
+    }
+
+    // Whether the objects of message may be sent as a delta, that is, whether this
+    // subscriber is sent the event it is a delta against right before. Every event
+    // counts, so that the fov_ids tracked are those the client keeps the objects of.
+    bool UseDelta(const Publication& message)
+    {
+        if (!objectDeltas_)
+        {
+            return false;
+        }
+        bool found;
+        auto& lastSequence = lastSequences_.touch(message.key, found);
+        const bool result = found && message.deltaBase != 0 && lastSequence == message.deltaBase;
+        lastSequence = message.sequence;
+        numDeltaStreams_.store(lastSequences_.size(), std::memory_order_relaxed);
+        return result;
+    }
+
+    // The message as sent to this subscriber, with the definitions of the labels it
+    // has not been sent yet and its trace if asked for; valid until the next call.
+    const grpc::ByteBuffer& Serialize(const Publication& message)
+    {
+        const auto& buffer = message.get(imageEncoding_, UseDelta(message));
+        numWrittenMessages_.store(numWrittenMessages_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+        std::string appended;
+        for (const auto& label : message.labels)
+        {
+            if (label.id() >= sentLabels_.size())
+            {
+                sentLabels_.resize(label.id() + 1);
+            }
+            if (!sentLabels_[label.id()])
+            {
+                sentLabels_[label.id()] = true;
+                AppendLabel(appended, label);
+            }
+        }
+
+        if (trace_ || parent_->traceHistograms_)
+        {
+            TraceStamps stamps;
+            stamps[TraceStage::PUSHED] = message.pushedNs;
+            stamps[TraceStage::SERIALIZED] = message.serializedNs;
+            stamps[TraceStage::DEQUEUED] = TraceNow();
+            if (parent_->traceHistograms_)
+            {
+                // Recorded once written.
+                writing_.push_back(stamps);
+            }
+            if (trace_)
+            {
+                AppendTrace(appended, stamps);
+            }
+        }
+
+        if (appended.empty())
+        {
+            return buffer;
+        }
+
+        // Repeated fields may be split, and message fields are merged, so the
+        // additions just follow the message.
+        std::vector<grpc::Slice> slices;
+        buffer.Dump(&slices);
+        slices.emplace_back(appended);
+        extended_ = grpc::ByteBuffer(slices.data(), slices.size());
+        return extended_;
+    }
+
+    // Wraps response_ and the next queued messages into batch_, each as a
+    // kBatchFieldNumber field, until the batch gets larger than maxBatchBytes
+    // or the credit runs out.
+    void MakeBatch(size_t& dropped)
+    {
+        std::vector<grpc::Slice> slices;
+        std::vector<grpc::Slice> messageSlices;
+        size_t size = 0;
+        do
+        {
+            std::string prefix;
+            AppendLengthDelimitedTag(prefix, kBatchFieldNumber);
+            const auto& buffer = Serialize(*response_);
+            Charge(buffer.Length());
+            AppendVarint(prefix, buffer.Length());
+            size += prefix.size() + buffer.Length();
+            slices.emplace_back(prefix);
+
+            buffer.Dump(&messageSlices);
+            slices.insert(slices.end(), messageSlices.begin(), messageSlices.end());
+        } while (size < parent_->options_.maxBatchBytes && HasCredit() && fifo_.pop(response_, dropped));
+
+        response_.reset();
+        batch_ = grpc::ByteBuffer(slices.data(), slices.size());
+    }
+
+    SubscriberRegistry<CallDataTemplate>& subscribers_;
 
-    // The means of communication with the gRPC runtime for an asynchronous server.
-    // The producer-consumer queue where for asynchronous server notifications.
     ServerBase* parent_;
 
+    // The producer-consumer queue where for asynchronous server notifications.
+    grpc::ServerCompletionQueue* cq_;
+
     S& subscriberService_;
 
     // Context for the rpc, allowing to tweak aspects of it such as the use
@@ -266,23 +1397,74 @@ private:
     grpc::ServerContext ctx_;
 
     // What we get from the client.
+    grpc::ByteBuffer rawRequest_;
     C request_;
 
     // What we send back to the client.
-    E response_;
+    SerializedMessage response_;
+    grpc::ByteBuffer batch_;
+    grpc::ByteBuffer extended_;
 
-    // The means to get back to the client.
-    grpc::ServerAsyncWriter<E> responder_;
+    // The means to get back to the client; stream_ if credited_.
+    grpc::ServerAsyncWriter<grpc::ByteBuffer> responder_;
+    grpc::ServerAsyncReaderWriter<grpc::ByteBuffer, grpc::ByteBuffer> stream_;
 
     // Let's implement a tiny state machine with the following states.
-    enum CallStatus { CREATE, PROCESS, FINISH, PUSH_TO_BACK };
+    enum CallStatus { CREATE, PROCESS, FINISH, PUSH_TO_BACK, IDLE, READ };
     CallStatus status_;  // The current serving state.
 
-    std::queue<P> fifo_;
-    std::mutex fifoMutex_;
+    SubscriberQueue fifo_;
 
     grpc::Alarm alarm_;
 
+    // Who may touch alarm_ while the call waits for messages: the thread that moved
+    // the state to WAKE_ARMING (which WAKE_REQUESTED keeps) or to WAKE_CANCELLING,
+    // until it stores WAKE_BUSY or WAKE_IDLE. wakeupRequested_ is written in WAKE_CANCELLING.
+    enum WakeState { WAKE_BUSY, WAKE_ARMING, WAKE_REQUESTED, WAKE_IDLE, WAKE_CANCELLING };
+    std::atomic<int> wakeState_ = WAKE_BUSY;
+    // When Wake was called, see TraceNow.
+    uint64_t wakeupRequested_ = 0;
+
+    std::atomic<uint64_t> numDropped_ = 0;
+
+    // Written by the thread proceeding, read by GetMetrics.
+    std::atomic<uint64_t> numWrittenMessages_ = 0;
+    std::atomic<uint64_t> numWrittenBytes_ = 0;
+    std::atomic<uint64_t> numWrites_ = 0;
+    // In nanoseconds, see writeStarted_.
+    std::atomic<uint64_t> totalWriteLatency_ = 0;
+    std::atomic<uint64_t> maxWriteLatency_ = 0;
+    std::atomic<size_t> numDeltaStreams_ = 0;
+    uint64_t writeStarted_ = 0;
+    // The stamps of the messages being written, if the server traces them.
+    std::vector<TraceStamps> writing_;
+    std::string peer_;
+
+    // Subscribed sdu_ids, sorted; all of them if empty.
+    std::vector<uint64_t> sduIds_;
+    // Used by Dispatch only.
+    bool touched_ = false;
+
+    // Written by the thread proceeding, read by GetMetrics; in nanoseconds.
+    std::atomic<uint64_t> numWakeups_ = 0;
+    std::atomic<uint64_t> totalWakeupLatency_ = 0;
+    std::atomic<uint64_t> maxWakeupLatency_ = 0;
+
     bool started_ = false;
+    const bool batched_;
+    const bool credited_;
+    // Window set by the client, 0 for no limit, and the sizes of the messages in
+    // flight, oldest first; see Fov::Credit.
+    uint32_t windowMessages_ = 0;
+    uint64_t windowBytes_ = 0;
+    std::deque<size_t> inFlight_;
+    uint64_t inFlightBytes_ = 0;
+    ImageEncoding imageEncoding_;
+    bool objectDeltas_ = false;
+    bool trace_ = false;
+    // Sequence of the last event written per fov_id, see UseDelta.
+    LruMap<std::string, uint64_t> lastSequences_{ OBJECT_DELTA_MAX_STREAMS };
+    // Indexed by label id, see Serialize.
+    std::vector<bool> sentLabels_;
 };
 
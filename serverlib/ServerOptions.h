@@ -0,0 +1,47 @@
+#pragma once
+
+/// @file
+
+#include <stddef.h>
+
+/*!
+ * \brief What to do when a message is pushed to a subscriber whose queue is full
+ *
+ * Numbered as the OverflowPolicy enum of Fov.proto, by which subscribers can choose theirs.
+ */
+enum class OverflowPolicy
+{
+    DROP_OLDEST = 1,    ///< drop the oldest queued messages
+    DROP_NEWEST = 2,    ///< drop the pushed message
+    COALESCE_LATEST = 3 ///< keep only the latest message per fov_id, then drop the oldest ones
+};
+
+/*!
+ * \brief The ServerOptions struct
+ */
+struct ServerOptions
+{
+    /// Maximum number of messages queued per subscriber
+    size_t maxQueuedMessages = 100;
+    /// Maximum number of bytes queued per subscriber
+    size_t maxQueuedBytes = 64 * 1024 * 1024;
+    /// Policy of the subscribers not choosing one
+    OverflowPolicy overflowPolicy = OverflowPolicy::DROP_OLDEST;
+    /// Number of completion queues the subscribers are spread across
+    size_t numCompletionQueues = 1;
+    /// Number of threads polling each completion queue
+    size_t numThreadsPerQueue = 1;
+    /// Number of threads scaling down and re-encoding the images for the subscribers asking for
+    /// it, along with the dispatching thread, which waits for them before queuing the messages
+    size_t numEncodingThreads = 2;
+    /// Maximum number of pushed messages waiting to be dispatched to the subscribers
+    size_t maxPendingPublications = 1000;
+    /// Size above which the batches of SubscribeBatch stop growing
+    size_t maxBatchBytes = 1024 * 1024;
+    /// Every how many events of a fov_id its objects are sent in full to the subscribers
+    /// asking for deltas; deltas are never sent if 0 or 1
+    size_t objectKeyframeInterval = 30;
+    /// Collect the time messages take to be serialized and written to each subscriber,
+    /// see IPublishSubscribeServer::GetTraceHistograms
+    bool trace = false;
+};
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+
+// Set of subscribers read by the publishers without taking any lock, indexed by
+// the keys (fov_ids) they subscribe to.
+// The subscribers are kept in an immutable snapshot that add and remove
+// replace (read-copy-update); a replaced snapshot is freed once the publishers
+// that might still be reading it are gone. Readers are tracked per epoch parity.
+// remove only returns when no publisher can call the subscriber anymore, so
+// that the subscriber may be deleted right away.
+template <typename T>
+class SubscriberRegistry
+{
+public:
+    class Snapshot
+    {
+    public:
+        // Calls f for each subscriber to key.
+        template <typename F>
+        void forEach(const std::string& key, F&& f) const
+        {
+            for (T* subscriber : wildcard_)
+            {
+                f(subscriber);
+            }
+            const auto it = byKey_.find(key);
+            if (it != byKey_.end())
+            {
+                for (T* subscriber : it->second)
+                {
+                    f(subscriber);
+                }
+            }
+        }
+
+        // Calls f once for each subscriber.
+        template <typename F>
+        void forAll(F&& f) const
+        {
+            std::unordered_set<T*> seen(wildcard_.begin(), wildcard_.end());
+            for (T* subscriber : wildcard_)
+            {
+                f(subscriber);
+            }
+            for (const auto& v : byKey_)
+            {
+                for (T* subscriber : v.second)
+                {
+                    if (seen.insert(subscriber).second)
+                    {
+                        f(subscriber);
+                    }
+                }
+            }
+        }
+
+    private:
+        friend class SubscriberRegistry;
+
+        // Subscribers to every key.
+        std::vector<T*> wildcard_;
+        std::unordered_map<std::string, std::vector<T*>> byKey_;
+    };
+
+    SubscriberRegistry() : snapshot_(new Snapshot) {}
+
+    ~SubscriberRegistry()
+    {
+        delete snapshot_.load();
+    }
+
+    SubscriberRegistry(const SubscriberRegistry&) = delete;
+    SubscriberRegistry& operator=(const SubscriberRegistry&) = delete;
+
+    // A subscriber without keys subscribes to all of them.
+    void add(T* subscriber, const std::vector<std::string>& keys)
+    {
+        std::lock_guard<std::mutex> locker(writerMutex_);
+        auto next = std::make_unique<Snapshot>(*snapshot_.load());
+        if (keys.empty())
+        {
+            next->wildcard_.push_back(subscriber);
+        }
+        for (const auto& key : keys)
+        {
+            auto& subscribers = next->byKey_[key];
+            if (std::find(subscribers.begin(), subscribers.end(), subscriber) == subscribers.end())
+            {
+                subscribers.push_back(subscriber);
+            }
+        }
+        replace(std::move(next));
+    }
+
+    void remove(T* subscriber)
+    {
+        std::lock_guard<std::mutex> locker(writerMutex_);
+        auto next = std::make_unique<Snapshot>(*snapshot_.load());
+        erase(next->wildcard_, subscriber);
+        for (auto it = next->byKey_.begin(); it != next->byKey_.end();)
+        {
+            erase(it->second, subscriber);
+            if (it->second.empty())
+            {
+                it = next->byKey_.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        replace(std::move(next));
+    }
+
+    // Calls f with the current snapshot; may be called concurrently.
+    template <typename F>
+    void read(F&& f) const
+    {
+        size_t parity;
+        for (;;)
+        {
+            const auto epoch = epoch_.load();
+            parity = epoch & 1;
+            ++readers_[parity].count;
+            if (epoch_.load() == epoch)
+            {
+                break;
+            }
+            --readers_[parity].count;
+        }
+
+        f(static_cast<const Snapshot&>(*snapshot_.load()));
+
+        readers_[parity].count.fetch_sub(1, std::memory_order_release);
+    }
+
+private:
+    static void erase(std::vector<T*>& subscribers, T* subscriber)
+    {
+        subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), subscriber), subscribers.end());
+    }
+
+    void replace(std::unique_ptr<Snapshot> next)
+    {
+        std::unique_ptr<Snapshot> previous(snapshot_.exchange(next.release()));
+
+        // Readers arriving from now on see the new snapshot; wait for the others.
+        const auto parity = epoch_.fetch_add(1) & 1;
+        while (readers_[parity].count.load() != 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    enum { CACHE_LINE_SIZE = 64 };
+
+    struct alignas(CACHE_LINE_SIZE) Readers
+    {
+        std::atomic<int64_t> count{ 0 };
+    };
+
+    std::atomic<Snapshot*> snapshot_;
+    std::atomic<uint64_t> epoch_{ 0 };
+    mutable Readers readers_[2];
+
+    std::mutex writerMutex_;
+};
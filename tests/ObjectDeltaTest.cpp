@@ -0,0 +1,201 @@
+// Publishes events of many more fov_ids than OBJECT_DELTA_MAX_STREAMS to a subscriber
+// asking for object deltas: the state kept for the deltas must stay bounded on both
+// sides, and the objects rebuilt by the client must be those published, whether the
+// fov_ids were forgotten in the meantime or not.
+
+#include "FovClient.h"
+#include "FovServer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace {
+
+const char kAddress[] = "127.0.0.1:50393";
+
+const size_t kNumFovIds = 3 * OBJECT_DELTA_MAX_STREAMS;
+const int kNumObjects = 4;
+
+// The objects of version of the events of fov; a single one moves between versions.
+std::vector<PlainFoiObject> MakeObjects(size_t fov, int version)
+{
+    std::vector<PlainFoiObject> result(kNumObjects);
+    for (int i = 0; i < kNumObjects; ++i)
+    {
+        result[i].id = i + 1;
+        result[i].x = static_cast<int32_t>(fov);
+        result[i].y = (i == static_cast<int>(fov % kNumObjects)) ? version : 0;
+        result[i].w = 10;
+        result[i].h = 10;
+        result[i].label = "label";
+    }
+    return result;
+}
+
+bool IsSame(const std::vector<PlainFoiObject>& a, const std::vector<PlainFoiObject>& b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (a[i].id != b[i].id || a[i].x != b[i].x || a[i].y != b[i].y || a[i].label != b[i].label)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Counts the events received, and those whose objects are not the ones published;
+// the sdu_id of the events tells their version.
+class Checker
+{
+public:
+    void operator()(const PlainFoiEvent& event)
+    {
+        const auto fov = std::stoul(event.fov_id);
+        if (!IsSame(event.objects, MakeObjects(fov, static_cast<int>(event.sdu_id))))
+        {
+            ++numWrong_;
+        }
+        ++numReceived_;
+    }
+
+    size_t received() const { return numReceived_; }
+    size_t wrong() const { return numWrong_; }
+
+private:
+    std::atomic<size_t> numReceived_{ 0 };
+    std::atomic<size_t> numWrong_{ 0 };
+};
+
+void Publish(IPublishSubscribeServer& server, size_t fov, int version)
+{
+    PlainFoiEvent event{};
+    event.fov_id = std::to_string(fov);
+    event.sdu_id = version;
+    event.objects = MakeObjects(fov, version);
+    server.Push(event);
+}
+
+bool WaitFor(const Checker& checker, size_t count)
+{
+    for (int i = 0; i < 100 && checker.received() < count; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return checker.received() == count;
+}
+
+} // namespace
+
+
+int main()
+{
+    ServerOptions serverOptions;
+    // Nothing is dropped, so that every event is checked.
+    serverOptions.maxQueuedMessages = 4 * kNumFovIds;
+    serverOptions.maxPendingPublications = 4 * kNumFovIds;
+    auto server = MakePublishSubscribeServer(kAddress, serverOptions);
+
+    Checker full;
+    auto fullClient = MakePublishSubscribeClient(kAddress, "full", std::ref(full));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    // Nothing is kept while no subscriber asks for deltas.
+    for (size_t fov = 0; fov < kNumFovIds; ++fov)
+    {
+        Publish(*server, fov, 1);
+    }
+    if (!WaitFor(full, kNumFovIds) || server->GetMetrics().objectDeltaStreams != 0)
+    {
+        std::cerr << "Object deltas kept without subscribers asking for them\n";
+        return EXIT_FAILURE;
+    }
+    const auto fullBytesBefore = fullClient->GetMetrics().receivedBytes;
+
+    Checker deltas;
+    SubscribeOptions options;
+    options.objectDeltas = true;
+    auto deltaClient = MakePublishSubscribeClient(kAddress, "deltas", std::ref(deltas), options);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    // Each fov_id gets a delta right after a keyframe. Then the fov_ids still tracked
+    // get another one, and some of those forgotten get their objects in full.
+    for (size_t fov = 0; fov < kNumFovIds; ++fov)
+    {
+        Publish(*server, fov, 2);
+        Publish(*server, fov, 3);
+    }
+    for (size_t fov = kNumFovIds - OBJECT_DELTA_MAX_STREAMS; fov < kNumFovIds; ++fov)
+    {
+        Publish(*server, fov, 4);
+    }
+    for (size_t fov = 0; fov < OBJECT_DELTA_MAX_STREAMS; ++fov)
+    {
+        Publish(*server, fov, 4);
+    }
+    const size_t numEvents = 2 * kNumFovIds + 2 * OBJECT_DELTA_MAX_STREAMS;
+    if (!WaitFor(deltas, numEvents) || !WaitFor(full, kNumFovIds + numEvents))
+    {
+        std::cerr << "Events missing: " << deltas.received() << " and " << full.received() << '\n';
+        return EXIT_FAILURE;
+    }
+    if (deltas.wrong() > 0 || full.wrong() > 0)
+    {
+        std::cerr << "Objects not rebuilt: " << deltas.wrong() << " and " << full.wrong() << '\n';
+        return EXIT_FAILURE;
+    }
+
+    const auto serverMetrics = server->GetMetrics();
+    const auto clientMetrics = deltaClient->GetMetrics();
+    size_t subscriberStreams = 0;
+    for (const auto& v : serverMetrics.subscribers)
+    {
+        subscriberStreams = std::max<size_t>(subscriberStreams, v.objectDeltaStreams);
+    }
+    std::cout << "Streams kept: server " << serverMetrics.objectDeltaStreams << ", subscriber "
+        << subscriberStreams << ", client " << clientMetrics.objectDeltaStreams << '\n';
+    if (serverMetrics.objectDeltaStreams > OBJECT_DELTA_MAX_STREAMS || subscriberStreams > OBJECT_DELTA_MAX_STREAMS
+        || clientMetrics.objectDeltaStreams > OBJECT_DELTA_MAX_STREAMS)
+    {
+        std::cerr << "Object delta state not bounded\n";
+        return EXIT_FAILURE;
+    }
+    // Deltas were sent, or the bound would not tell much.
+    if (clientMetrics.receivedBytes >= fullClient->GetMetrics().receivedBytes - fullBytesBefore)
+    {
+        std::cerr << "No object deltas sent\n";
+        return EXIT_FAILURE;
+    }
+
+    // The objects are dropped once the last subscriber asking for deltas is gone, which
+    // the server finds out writing the next event to it.
+    deltaClient.reset();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    Publish(*server, 0, 5);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    Publish(*server, 0, 6);
+    if (server->GetMetrics().objectDeltaStreams != 0)
+    {
+        std::cerr << "Object deltas kept once their subscriber is gone\n";
+        return EXIT_FAILURE;
+    }
+
+    fullClient.reset();
+    server.reset();
+    std::cout << "Object delta state bounded\n";
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,81 @@
+// Destroys servers while subscribers are still connected: an idle one, one whose
+// writes are held back by a slow callback and a credited one out of credit.
+// Fails if the servers take long to go, or never do.
+
+#include "FovClient.h"
+#include "FovServer.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+namespace {
+
+const char kEventAddress[] = "127.0.0.1:50391";
+const char kNotifyAddress[] = "127.0.0.1:50392";
+
+const auto kMaxShutdownTime = std::chrono::seconds(5);
+
+} // namespace
+
+
+int main()
+{
+    ServerOptions serverOptions;
+    serverOptions.numCompletionQueues = 2;
+    serverOptions.numThreadsPerQueue = 2;
+    auto server = MakePublishSubscribeServer(kEventAddress, serverOptions);
+    auto notifyServer = MakeNotifyServer(kNotifyAddress, serverOptions);
+
+    std::vector<std::unique_ptr<IPublishSubscribeClient>> clients;
+    clients.push_back(MakePublishSubscribeClient(kEventAddress, "idle", [](const PlainFoiEvent&) {}));
+    clients.push_back(MakePublishSubscribeClient(kEventAddress, "slow", [](const PlainFoiEvent&) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }));
+    SubscribeOptions credited;
+    credited.creditMessages = 2;
+    credited.manualCredit = true;
+    clients.push_back(MakePublishSubscribeClient(kEventAddress, "nocredit", [](const PlainFoiEvent&) {}, credited));
+    SubscribeOptions batched;
+    batched.batched = true;
+    clients.push_back(MakeNotifyClient(kNotifyAddress, "idle", [](const PlainFoiNotify&) {}, batched));
+
+    // Let the subscriptions reach the servers.
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    auto image = std::make_shared<PlainFoiImage>();
+    image->data = std::vector<char>(256 * 1024, 0);
+    for (uint64_t i = 0; i < 50; ++i)
+    {
+        PlainFoiEvent event{};
+        event.fov_id = "shutdown";
+        event.sdu_id = i;
+        event.image = image;
+        server->Push(event);
+        PlainFoiNotify notification{};
+        notification.fov_id = "shutdown";
+        notifyServer->Push(notification);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    auto destroyed = std::async(std::launch::async, [&server, &notifyServer] {
+        server.reset();
+        notifyServer.reset();
+    });
+    if (destroyed.wait_for(kMaxShutdownTime) != std::future_status::ready)
+    {
+        std::cerr << "The servers were not destroyed within "
+            << std::chrono::duration_cast<std::chrono::seconds>(kMaxShutdownTime).count() << " s\n";
+        // The servers are stuck: do not wait for them.
+        std::quick_exit(EXIT_FAILURE);
+    }
+
+    clients.clear();
+    std::cout << "Servers destroyed with their subscribers connected\n";
+    return EXIT_SUCCESS;
+}
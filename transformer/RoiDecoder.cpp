@@ -0,0 +1,135 @@
+#include "RoiDecoder.h"
+
+#ifdef HAVE_JPEG_ROI_DECODING
+
+#include "exif.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <csetjmp>
+
+#include <jpeglib.h>
+
+
+namespace {
+
+// libjpeg exits on errors unless error_exit jumps out.
+struct ErrorManager
+{
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+void OnError(j_common_ptr cinfo)
+{
+    longjmp(reinterpret_cast<ErrorManager*>(cinfo->err)->jump, 1);
+}
+
+void OnMessage(j_common_ptr)
+{
+    // Warnings about corrupt data are not worth a line each.
+}
+
+// The orientation of the image, as read by jpeg_read_header into the saved APP1 markers.
+int GetOrientation(const jpeg_decompress_struct& cinfo)
+{
+    for (auto marker = cinfo.marker_list; marker; marker = marker->next)
+    {
+        if (marker->marker == JPEG_APP0 + 1)
+        {
+            const int orientation = ReadExifOrientation(marker->data, marker->data_length);
+            if (orientation != 1)
+            {
+                return orientation;
+            }
+        }
+    }
+    return 1;
+}
+
+// Decodes into rows, which is left as is if this fails, and tells where roi is in
+// there. libjpeg errors jump back into this function, so nothing in its frame has
+// a destructor or is read after the jump: the results live in the caller's frame.
+bool Decode(jpeg_decompress_struct& cinfo, ErrorManager& errorManager, const char* data, size_t size,
+    const cv::Rect& roi, cv::Mat& rows, cv::Rect& clipped, int& xoffsetInRows)
+{
+    if (setjmp(errorManager.jump))
+    {
+        return false;
+    }
+
+    jpeg_mem_src(&cinfo, reinterpret_cast<const unsigned char*>(data), static_cast<unsigned long>(size));
+    // roi is in the frame of the oriented image, which imdecode returns.
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xFFFF);
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK || GetOrientation(cinfo) != 1)
+    {
+        return false;
+    }
+    cinfo.out_color_space = JCS_EXT_BGR;
+    jpeg_start_decompress(&cinfo);
+
+    clipped = roi & cv::Rect(0, 0, static_cast<int>(cinfo.output_width), static_cast<int>(cinfo.output_height));
+    if (clipped.empty())
+    {
+        return false;
+    }
+
+    // Widened to the MCU boundaries, after a column more on each side: the chroma
+    // upsampling at the edges of a crop does not see the neighbouring columns.
+    JDIMENSION xoffset = (clipped.x > 0) ? clipped.x - 1 : 0;
+    JDIMENSION width = std::min<JDIMENSION>(clipped.x + clipped.width + 1, cinfo.output_width) - xoffset;
+    jpeg_crop_scanline(&cinfo, &xoffset, &width);
+    xoffsetInRows = clipped.x - static_cast<int>(xoffset);
+
+    if (clipped.y > 0)
+    {
+        jpeg_skip_scanlines(&cinfo, clipped.y);
+    }
+
+    rows.create(clipped.height, static_cast<int>(width), CV_8UC3);
+    for (int i = 0; i < clipped.height; ++i)
+    {
+        JSAMPROW row = rows.ptr<unsigned char>(i);
+        if (jpeg_read_scanlines(&cinfo, &row, 1) != 1)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+
+cv::Mat DecodeJpegRoi(const char* data, size_t size, const cv::Rect& roi)
+{
+    jpeg_decompress_struct cinfo;
+    ErrorManager errorManager;
+    cinfo.err = jpeg_std_error(&errorManager.pub);
+    errorManager.pub.error_exit = OnError;
+    errorManager.pub.output_message = OnMessage;
+    jpeg_create_decompress(&cinfo);
+
+    cv::Mat rows;
+    cv::Rect clipped;
+    int xoffset = 0;
+    const bool decoded = Decode(cinfo, errorManager, data, size, roi, rows, clipped, xoffset);
+
+    // The rows below, if any, are left alone.
+    jpeg_destroy_decompress(&cinfo);
+    if (!decoded)
+    {
+        return {};
+    }
+    return rows(cv::Rect(xoffset, 0, clipped.width, clipped.height));
+}
+
+#else
+
+// Without libjpeg-turbo, every image is left to the cv::imdecode fallback.
+cv::Mat DecodeJpegRoi(const char*, size_t, const cv::Rect&)
+{
+    return {};
+}
+
+#endif
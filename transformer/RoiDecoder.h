@@ -0,0 +1,14 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+
+#include <cstddef>
+
+// Decodes the part of a JPEG image within roi, in BGR, without decoding the rest:
+// the rows above are skipped, the columns are cropped to whole MCUs and the decoder
+// stops right after the last row (libjpeg-turbo 1.5 or later; always empty otherwise,
+// see HAVE_JPEG_ROI_DECODING).
+// roi is clipped to the image. Returns an empty matrix if the data are not a JPEG
+// image, if its EXIF orientation is not upright or if roi is outside of it, so that
+// the caller can fall back to cv::imdecode, which applies the orientation.
+cv::Mat DecodeJpegRoi(const char* data, size_t size, const cv::Rect& roi);
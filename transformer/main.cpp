@@ -5,6 +5,7 @@
 #include "opencv2/highgui.hpp"
 #include "opencv2/imgproc.hpp"
 
+#include "RoiDecoder.h"
 
 #include "fqueue.h"
 
@@ -12,7 +13,16 @@
 
 #include <tuple>
 #include <atomic>
+#include <chrono>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace {
 
@@ -43,7 +53,7 @@ void setSignalHandler()
 }
 
 
-bool initCategory(PlainFoiObject & object, PlainFoiNotify &notification)
+bool initCategory(const PlainFoiObject & object, PlainFoiNotify &notification)
 {
     if (object.score >= 0.01)
     {
@@ -59,74 +69,261 @@ bool initCategory(PlainFoiObject & object, PlainFoiNotify &notification)
     return true;
 }
 
-} // namespace
 
+// A received frame, numbered among those of its fov_id.
+struct Frame
+{
+    PlainFoiEvent event;
+    uint64_t sequence = 0;
+    // Tells the worker popping it to stop.
+    bool last = false;
+};
 
-inline size_t GetSize(const PlainFoiEvent& obj)
+inline size_t GetSize(const Frame& frame)
 {
-    return obj.image->data.size();
+    return frame.event.image ? frame.event.image->data.size() : 0;
 }
 
 
-int main()
+// Publishes the notifications of each fov_id in the order their frames were received,
+// whatever the order the workers are done with them in. Push only serializes, so it
+// is called under the lock.
+class OrderedPublisher
 {
-    setSignalHandler();
+public:
+    explicit OrderedPublisher(INotifyServer& server) : server_(server) {}
 
-    try {
+    // Numbers a frame received among those of its fov_id; each number must be completed
+    // once, even if the frame is dropped, not to hold back the next ones.
+    uint64_t enter(const std::string& fovId)
+    {
+        std::lock_guard<std::mutex> locker(mutex_);
+        return streams_[fovId].entered++;
+    }
 
-        FQueue<PlainFoiEvent, 10 * 1024 * 1024, 10> queue;
+    // notification is empty if nothing is to be published for the frame.
+    void complete(const std::string& fovId, uint64_t sequence, std::optional<PlainFoiNotify> notification)
+    {
+        std::lock_guard<std::mutex> locker(mutex_);
+        auto stream = streams_.find(fovId);
+        if (stream == streams_.end())
+        {
+            return;
+        }
+        auto& done = stream->second.done;
+        auto& next = stream->second.next;
+        done.emplace(sequence, std::move(notification));
+        for (auto it = done.begin(); it != done.end() && it->first == next; it = done.erase(it), ++next)
+        {
+            if (it->second)
+            {
+                server_.Push(*it->second);
+            }
+        }
+        // Numbered again from 0 by the next frame.
+        if (next == stream->second.entered)
+        {
+            streams_.erase(stream);
+        }
+    }
 
-        auto lam = [&queue](const PlainFoiEvent& notification) {
-			auto &object = notification.objects[0];
-            queue.push(notification);
-        };
-        client = MakePublishSubscribeClient("localhost:50051", "42", lam);
+private:
+    struct Stream
+    {
+        uint64_t entered = 0;
+        uint64_t next = 0;
+        // Frames done ahead of the next one.
+        std::map<uint64_t, std::optional<PlainFoiNotify>> done;
+    };
+
+    INotifyServer& server_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, Stream> streams_;
+};
+
+// Completes a frame when leaving the scope, with the notification set if any, so that
+// a frame aborted by an exception is skipped rather than holding back its fov_id.
+class FrameCompletion
+{
+public:
+    FrameCompletion(OrderedPublisher& publisher, const Frame& frame) :
+        publisher_(publisher), fovId_(frame.event.fov_id), sequence_(frame.sequence) {}
+    FrameCompletion(const FrameCompletion&) = delete;
+    FrameCompletion& operator=(const FrameCompletion&) = delete;
+
+    ~FrameCompletion()
+    {
+        try {
+            publisher_.complete(fovId_, sequence_, std::move(notification));
+        }
+        catch (const std::exception& ex) {
+            std::cerr << "Frame not published: " << ex.what() << '\n';
+        }
+    }
+
+    std::optional<PlainFoiNotify> notification;
+
+private:
+    OrderedPublisher& publisher_;
+    const std::string fovId_;
+    const uint64_t sequence_;
+};
 
-        auto server = MakeNotifyServer("0.0.0.0:50052");
-		
 
-        PlainFoiEvent event;
-        while (!shutdownRequested && queue.pop(event))
+// Margin around the object in the crop sent along with the frame.
+enum { kRoiMargin = 100 };
+
+// The part of the image within roi, clipped; decoded alone if the image is a JPEG one.
+cv::Mat decodeRoi(const PlainFoiImage& image, const cv::Rect& roi)
+{
+    auto result = DecodeJpegRoi(image.data.data(), image.data.size(), roi);
+    if (result.empty())
+    {
+        auto full_image = cv::imdecode(cv::_InputArray(image.data.data(), static_cast<int>(image.data.size())), cv::IMREAD_COLOR);
+        const auto clipped = roi & cv::Rect(0, 0, full_image.cols, full_image.rows);
+        if (!clipped.empty())
         {
-			PlainFoiNotify notification;
+            result = full_image(clipped);
+        }
+    }
+    return result;
+}
 
-			notification.fov_id = event.fov_id;
-			notification.sdu_id = event.sdu_id;
-			notification.timestamp = event.timestamp;
-			notification.coordinate = event.coordinate;
-			notification.images.push_back(event.image);
-			notification.status = 0;
-			notification.frame_x      = event.objects[0].x;
-			notification.frame_y      = event.objects[0].y;
-			notification.frame_width  = event.objects[0].w;
-			notification.frame_height = event.objects[0].h;
+// The crop around the object comes after the frame, or alone if roiOnly.
+std::optional<PlainFoiNotify> transform(const PlainFoiEvent& event, bool roiOnly)
+{
+    if (!event.image || event.objects.empty())
+    {
+        return {};
+    }
+
+    PlainFoiNotify notification;
+
+    notification.fov_id = event.fov_id;
+    notification.sdu_id = event.sdu_id;
+    notification.timestamp = event.timestamp;
+    notification.coordinate = event.coordinate;
+    if (!roiOnly)
+    {
+        notification.images.push_back(event.image);
+    }
+    notification.status = 0;
+    notification.frame_x      = event.objects[0].x;
+    notification.frame_y      = event.objects[0].y;
+    notification.frame_width  = event.objects[0].w;
+    notification.frame_height = event.objects[0].h;
+
+    auto &object = event.objects[0];
+
+    const cv::Rect roi = {object.x - kRoiMargin, object.y - kRoiMargin, object.w + 2 * kRoiMargin, object.h + 2 * kRoiMargin};
 
-			auto full_image = cv::imdecode(event.image->data, cv::IMREAD_COLOR);
+    const auto crop = decodeRoi(*event.image, roi);
+    std::vector<uchar> buffer;
+    if (!crop.empty() && cv::imencode(".jpg", crop, buffer))
+    {
+        auto image = std::make_shared<PlainFoiImage>();
+        image->w = crop.cols;
+        image->h = crop.rows;
+        image->data = std::vector<char>(buffer.begin(), buffer.end());
+        notification.images.push_back(std::move(image));
+    }
 
-			auto &object = event.objects[0];
+    notification.object_width = object.w;
+    notification.object_height = object.h;
 
+    if (!initCategory(object, notification))
+    {
+        return {};
+    }
 
-			cv::Rect roi = {object.x, object.y, object.w, object.h};
+    notification.fov_id = std::to_string(
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
 
-			auto image = full_image(roi);
+    return notification;
+}
 
-			notification.object_width = object.w;
-			notification.object_height = object.h;
+} // namespace
 
-			if(initCategory(object, notification))
-			{
-				notification.fov_id = std::to_string(
-                    std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
 
-				server->Push(notification);
+// usage: FovTransformer [--roi-only] [number of decode workers]
+int main(int argc, char* argv[])
+{
+    setSignalHandler();
+
+    try {
+        unsigned numWorkers = std::max(std::thread::hardware_concurrency(), 1u);
+        bool roiOnly = false;
+        for (int i = 1; i < argc; ++i)
+        {
+            if (std::string(argv[i]) == "--roi-only")
+            {
+                roiOnly = true;
+            }
+            else
+            {
+                const auto value = std::stoi(argv[i]);
+                if (value < 1)
+                {
+                    throw std::invalid_argument("Invalid number of decode workers: " + std::string(argv[i]));
+                }
+                numWorkers = value;
+            }
+        }
+
+        // Deep enough for every worker to have frames waiting, so that the client's
+        // completion queue thread is only held back once all of them fall behind.
+        FQueue<Frame, 100 * 1024 * 1024, 100> queue;
+
+        auto server = MakeNotifyServer("0.0.0.0:50052");
+        OrderedPublisher publisher(*server);
+
+        auto lam = [&queue, &publisher](const PlainFoiEvent& notification) {
+            const auto sequence = publisher.enter(notification.fov_id);
+            if (!queue.push({ notification, sequence }, [] { return shutdownRequested.load(); }))
+            {
+                // Dropped on shutdown.
+                publisher.complete(notification.fov_id, sequence, {});
+            }
+        };
+        client = MakePublishSubscribeClient("localhost:50051", "42", lam);
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < numWorkers; ++i)
+        {
+            workers.emplace_back([&queue, &publisher, roiOnly] {
+                Frame frame;
+                while (queue.pop(frame) && !frame.last)
+                {
+                    FrameCompletion completion(publisher, frame);
+                    try {
+                        completion.notification = transform(frame.event, roiOnly);
+                    }
+                    catch (const std::exception& ex) {
+                        std::cerr << "Frame skipped: " << ex.what() << '\n';
+                    }
+                    catch (...) {
+                        std::cerr << "Frame skipped\n";
+                    }
+                }
+            });
+        }
+
+        while (!shutdownRequested)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        for (unsigned i = 0; i < numWorkers; ++i)
+        {
+            queue.push({ {}, 0, true });
+        }
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
 
-				cv::Mat frame;
-				roi.x = std::max(0, roi.x - 100);
-				roi.y = std::max(0, roi.y - 100);
-				roi.width = (roi.x + roi.width + 200) < full_image.cols ? roi.width + 200 : full_image.cols - roi.x; 
-				roi.height = (roi.y + roi.height + 200) < full_image.rows ? roi.height + 200 : full_image.rows - roi.y;
-			}
-		}           
+        // Let the client's thread out of a full queue.
+        queue.notify();
+        client.reset();
     }
     catch (const std::exception& ex) {
         std::cerr << "Exception: " << typeid(ex).name() << ": " << ex.what();
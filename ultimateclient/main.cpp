@@ -58,7 +58,12 @@ int main()
         auto lam = [&queue](const PlainFoiNotify& notification) {
             queue.push(notification);
         };
-        client = MakeNotifyClient("localhost:50052", "42", lam);
+        // The frames are shown at half resolution, scaled down by the server.
+        SubscribeOptions options;
+        options.imageScale = ImageScale::HALF;
+        options.imageQuality = ImageQuality::HIGH;
+        client = MakeNotifyClient("localhost:50052", "42", lam, options);
+        const double scale = 0.5;
 
         cv::Scalar clr{ 0, 0, 255 };
 
@@ -68,18 +73,17 @@ int main()
             const auto& image = notification.images[0];
 
             std::cout << notification.coordinate << ' ' << image->data.size() << '\n';
-			auto frame = cv::imdecode(image->data, cv::IMREAD_COLOR);
+			auto frame = cv::imdecode(cv::_InputArray(image->data.data(), static_cast<int>(image->data.size())), cv::IMREAD_COLOR);
 
             //for (auto& v : notification.objects)
             //{
                 //std::cout << v.x << ' ' << v.y << ' ' << v.w << ' ' << v.h << '\n';
-                cv::Rect rct(notification.frame_x, notification.frame_y, notification.frame_width, notification.frame_height);
-                cv::rectangle(frame, rct, clr, 3);
-				putText(frame, notification.category, cv::Point2f(notification.frame_x + 1, notification.frame_y - 1), cv::FONT_HERSHEY_SIMPLEX, 1, clr, 1);
+                cv::Rect rct(notification.frame_x * scale, notification.frame_y * scale, notification.frame_width * scale, notification.frame_height * scale);
+                cv::rectangle(frame, rct, clr, 2);
+				putText(frame, notification.category, cv::Point2f(rct.x + 1, rct.y - 1), cv::FONT_HERSHEY_SIMPLEX, 0.5, clr, 1);
             //}
 
             // Display the output image
-			cv::resize(frame, frame, {frame.cols/2, frame.rows/2}, cv::INTER_NEAREST);
             cv::imshow(windowName, frame);
 
             // Break out of the loop if the user presses the Esc key